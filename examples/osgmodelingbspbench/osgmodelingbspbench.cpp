@@ -0,0 +1,283 @@
+/* -*-c++-*- osgModeling Example: Benchmark of BSP tree splitting and construction
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <osg/Timer>
+#include <osg/ArgumentParser>
+
+#include <osgModeling/Utilities>
+#include <osgModeling/Lathe>
+#include <osgModeling/Extrude>
+#include <osgModeling/BoolOperator>
+#include <osgModeling/ModelVisitor>
+#include <osgModeling/BspTree>
+
+typedef osgModeling::BspTree::BspFace BspFace;
+typedef osgModeling::BspTree::FaceList FaceList;
+
+inline float randomValue()
+{
+    return (float)rand()/(float)RAND_MAX*2.0f - 1.0f;
+}
+
+void createRandomInput( unsigned int numFaces, FaceList& faces, std::vector<osg::Plane>& planes )
+{
+    srand( 1 );
+    for ( unsigned int i=0; i<numFaces; ++i )
+    {
+        // Regular polygons with 3-8 edges, and planes passing near their centers.
+        BspFace face;
+        unsigned int edges = 3 + rand()%6;
+        osg::Vec3 center( randomValue(), randomValue(), randomValue() );
+        osg::Vec3 axisX( randomValue(), randomValue(), randomValue() ), axisY;
+        osg::Vec3 normal( randomValue(), randomValue(), randomValue() );
+        normal.normalize();
+        axisX = normal ^ axisX; axisX.normalize();
+        axisY = normal ^ axisX;
+        for ( unsigned int j=0; j<edges; ++j )
+        {
+            double angle = 2.0*osg::PI*j/edges;
+            face._points.push_back( center + axisX*cos(angle) + axisY*sin(angle) );
+        }
+        faces.push_back( face );
+
+        osg::Vec3 planeNormal( randomValue(), randomValue(), randomValue() );
+        planeNormal.normalize();
+        planes.push_back( osg::Plane(planeNormal, center+osg::Vec3(randomValue(), randomValue(), randomValue())*0.5f) );
+    }
+}
+
+bool samePoints( const BspFace& face1, const BspFace& face2 )
+{
+    if ( face1._points.size()!=face2._points.size() ) return false;
+    for ( unsigned int i=0; i<face1._points.size(); ++i )
+    {
+        if ( face1._points[i]!=face2._points[i] ) return false;
+    }
+    return true;
+}
+
+// Check that splitFace() gives the same classification and points as partitionFace(), with random planes and
+// planes passing through a vertex or 2 vertices of the face. Returns the number of different results.
+unsigned int checkSplitting( unsigned int numFaces )
+{
+    FaceList faces;
+    std::vector<osg::Plane> planes;
+    createRandomInput( numFaces, faces, planes );
+
+    std::cout << "===== Checking splitFace() against partitionFace() with " << numFaces << " faces =====" << std::endl;
+    unsigned int mismatches = 0;
+    BspFace posFace, negFace;
+    for ( unsigned int i=0; i<numFaces; ++i )
+    {
+        const BspFace& face = faces[i];
+        unsigned int size = face._points.size();
+        const osg::Vec3& p0 = face._points[rand()%size];
+        const osg::Vec3& p1 = face._points[rand()%size];
+        osg::Vec3 normal1( randomValue(), randomValue(), randomValue() ), normal2 = (p1-p0)^normal1;
+        normal1.normalize();
+        normal2.normalize();
+
+        osg::Plane testPlanes[3] = { planes[i], osg::Plane(normal1, p0), osg::Plane(normal2, p0) };
+        for ( unsigned int j=0; j<3; ++j )
+        {
+            BspFace refPos, refNeg;
+            osgModeling::BspTree::FaceClassify refType =
+                osgModeling::BspTree::partitionFace( testPlanes[j], face, refPos, refNeg );
+            osgModeling::BspTree::FaceClassify type =
+                osgModeling::BspTree::splitFace( testPlanes[j], face, posFace, negFace );
+            if ( type!=refType || !samePoints(posFace, refPos) || !samePoints(negFace, refNeg) )
+                mismatches++;
+        }
+    }
+    std::cout << "- Different results: " << mismatches << " of " << numFaces*3 << std::endl;
+    return mismatches;
+}
+
+void benchmarkSplitting( unsigned int numFaces, unsigned int iterations )
+{
+    FaceList faces;
+    std::vector<osg::Plane> planes;
+    createRandomInput( numFaces, faces, planes );
+
+    std::cout << "===== Splitting " << numFaces << " faces, " << iterations << " iterations =====" << std::endl;
+    unsigned int crossed = 0;
+    osg::Timer_t t1 = osg::Timer::instance()->tick();
+    for ( unsigned int n=0; n<iterations; ++n )
+    {
+        for ( unsigned int i=0; i<numFaces; ++i )
+        {
+            BspFace posFace, negFace;
+            if ( osgModeling::BspTree::partitionFace(planes[i], faces[i], posFace, negFace)==osgModeling::BspTree::CROSS_FACE )
+                crossed++;
+        }
+    }
+    osg::Timer_t t2 = osg::Timer::instance()->tick();
+    double refTime = osg::Timer::instance()->delta_s( t1, t2 );
+    std::cout << "- partitionFace(): " << refTime << "s, " << crossed << " crossed" << std::endl;
+
+    crossed = 0;
+    BspFace posFace, negFace;
+    t1 = osg::Timer::instance()->tick();
+    for ( unsigned int n=0; n<iterations; ++n )
+    {
+        for ( unsigned int i=0; i<numFaces; ++i )
+        {
+            if ( osgModeling::BspTree::splitFace(planes[i], faces[i], posFace, negFace)==osgModeling::BspTree::CROSS_FACE )
+                crossed++;
+        }
+    }
+    t2 = osg::Timer::instance()->tick();
+    double fastTime = osg::Timer::instance()->delta_s( t1, t2 );
+    std::cout << "- splitFace() with reused buffers: " << fastTime << "s, " << crossed << " crossed" << std::endl;
+    if ( fastTime>0.0 ) std::cout << "- Speedup: " << refTime/fastTime << "x" << std::endl;
+}
+
+void benchmarkConstruction( unsigned int segments, unsigned int samples, bool parallel )
+{
+    osg::ref_ptr<osgModeling::Curve> profile = new osgModeling::Curve;
+    for ( unsigned int i=0; i<=segments/2; ++i )
+    {
+        double angle = osg::PI*i/(segments/2);
+        profile->addPathPoint( osg::Vec3(sin(angle), 0.0f, cos(angle)) );
+    }
+
+    osg::ref_ptr<osgModeling::Lathe> geom = new osgModeling::Lathe;
+    geom->setLatheSegments( segments );
+    geom->setLatheAxis( osg::Vec3(0.0f, 0.0f, 1.0f) );
+    geom->setProfile( profile.get() );
+    geom->update();
+
+    osg::ref_ptr<osgModeling::Model> model = new osgModeling::Model( *geom );
+    osgModeling::BspTree* bsp = new osgModeling::BspTree( samples );
+    bsp->setParallelBuild( parallel );
+    model->setBspTree( bsp );
+
+    std::cout << "===== Constructing BSP tree of a sphere with " << segments << " segments =====" << std::endl;
+    osg::Timer_t t1 = osg::Timer::instance()->tick();
+    osgModeling::ModelVisitor::buildBSP( *model );
+    osg::Timer_t t2 = osg::Timer::instance()->tick();
+    std::cout << "- Available Faces: " << bsp->getFaceList().size() << std::endl;
+    std::cout << "- Constructing Time: " << osg::Timer::instance()->delta_s( t1, t2 ) << "s" << std::endl;
+}
+
+osgModeling::Model* createExtrudedModel( osgModeling::Curve* profile, const osg::Vec3& dir, double length )
+{
+    osg::ref_ptr<osgModeling::Extrude> geom = new osgModeling::Extrude;
+    geom->setGenerateParts( osgModeling::Model::ALL_PARTS );
+    geom->setExtrudeDirection( dir );
+    geom->setExtrudeLength( length );
+    geom->setProfile( profile );
+    geom->update();
+
+    osgModeling::Model* model = new osgModeling::Model( *geom );
+    model->setBspTree( new osgModeling::BspTree );
+    osgModeling::ModelVisitor::buildBSP( *model );
+    return model;
+}
+
+void benchmarkDrilling( unsigned int numCutters, bool sequential )
+{
+    // A plate drilled by a grid of small cylinders.
+    unsigned int grid = 1;
+    while ( grid*grid<numCutters ) grid++;
+    double size = grid;
+    double cp[5][3] = {
+        {size,-size,0.2f}, {-size,-size,0.2f}, {-size,-size,-0.2f}, {size,-size,-0.2f}, {size,-size,0.2f} };
+    osg::ref_ptr<osgModeling::Curve> plateProfile = new osgModeling::Curve;
+    plateProfile->setPath( 15, &cp[0][0] );
+    osg::ref_ptr<osgModeling::Model> plate = createExtrudedModel( plateProfile.get(), osg::Vec3(0.0f, 1.0f, 0.0f), size*2.0 );
+
+    std::vector< osg::ref_ptr<osgModeling::Model> > cutters;
+    osgModeling::BoolOperator::BspTreeList cutterTrees;
+    for ( unsigned int i=0; i<numCutters; ++i )
+    {
+        osg::Vec3 center( 2.0*(i%grid)-size+1.0, 2.0*(i/grid)-size+1.0, 0.5f );
+        osg::ref_ptr<osgModeling::Curve> profile = new osgModeling::Curve;
+        for ( unsigned int j=0; j<=12; ++j )
+        {
+            double angle = 2.0*osg::PI*j/12;
+            profile->addPathPoint( center + osg::Vec3(0.3*cos(angle), 0.3*sin(angle), 0.0f) );
+        }
+        cutters.push_back( createExtrudedModel(profile.get(), osg::Vec3(0.0f, 0.0f, -1.0f), 1.0) );
+        cutterTrees.push_back( cutters.back()->getBspTree() );
+    }
+
+    std::cout << "===== Drilling a plate with " << numCutters << " cutters =====" << std::endl;
+    osg::ref_ptr<osgModeling::BoolOperator> boolOp = new osgModeling::BoolOperator( osgModeling::BoolOperator::BOOL_DIFFERENCE );
+    osg::ref_ptr<osg::Geometry> result = new osg::Geometry;
+    osg::Timer_t t1 = osg::Timer::instance()->tick();
+    boolOp->outputBatch( plate->getBspTree(), cutterTrees, result.get() );
+    osg::Timer_t t2 = osg::Timer::instance()->tick();
+    std::cout << "- Batched: " << osg::Timer::instance()->delta_s( t1, t2 ) << "s" << std::endl;
+    if ( !sequential ) return;
+
+    // Operate one by one, rebuilding the BSP tree of the intermediate result each time.
+    osg::ref_ptr<osgModeling::Model> current = plate;
+    t1 = osg::Timer::instance()->tick();
+    for ( unsigned int i=0; i<numCutters; ++i )
+    {
+        result = new osg::Geometry;
+        boolOp->setOperands( current.get(), cutters[i].get() );
+        boolOp->output( result.get() );
+
+        current = new osgModeling::Model( *result );
+        current->setBspTree( new osgModeling::BspTree );
+        osgModeling::ModelVisitor::buildBSP( *current );
+    }
+    t2 = osg::Timer::instance()->tick();
+    std::cout << "- Sequential: " << osg::Timer::instance()->delta_s( t1, t2 ) << "s" << std::endl;
+}
+
+int main( int argc, char** argv )
+{
+    osg::ArgumentParser arguments( &argc, argv );
+    arguments.getApplicationUsage()->setApplicationName( arguments.getApplicationName() );
+    arguments.getApplicationUsage()->setDescription( arguments.getApplicationName()+" checks the BSP splitting kernel against partitionFace(), and benchmarks it, BSP construction and batched Boolean operations." );
+    arguments.getApplicationUsage()->setCommandLineUsage( arguments.getApplicationName()+" [options]" );
+    arguments.getApplicationUsage()->addCommandLineOption( "-h or --help","Display help documents." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--faces", "Number of random faces to split. Default is 100000." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--iterations", "Number of splitting passes over all faces. Default is 10." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--segments", "Segments of the sphere used for BSP construction. Default is 64." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--samples", "Sampling number for dividing faces. Default is 5." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--parallel", "Construct the BSP tree in parallel." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--cutters", "Number of cutters drilling a plate. Default is 100." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--sequential", "Also drill the plate with cutters one by one." );
+
+    if ( arguments.read("-h") || arguments.read("--help") )
+    {
+        std::cout << arguments.getApplicationUsage()->getCommandLineUsage() << std::endl;
+        arguments.getApplicationUsage()->write( std::cout, arguments.getApplicationUsage()->getCommandLineOptions() );
+        return 1;
+    }
+
+    unsigned int numFaces, iterations, segments, samples, numCutters;
+    if ( !arguments.read("--faces", numFaces) ) numFaces = 100000;
+    if ( !arguments.read("--iterations", iterations) ) iterations = 10;
+    if ( !arguments.read("--segments", segments) ) segments = 64;
+    if ( !arguments.read("--samples", samples) ) samples = 5;
+    if ( !arguments.read("--cutters", numCutters) ) numCutters = 100;
+    bool parallel = arguments.read("--parallel");
+    bool sequential = arguments.read("--sequential");
+
+    if ( checkSplitting(numFaces) ) return 1;
+    benchmarkSplitting( numFaces, iterations );
+    benchmarkConstruction( segments, samples, parallel );
+    benchmarkDrilling( numCutters, sequential );
+    return 0;
+}
@@ -23,7 +23,8 @@
 #include <osgModeling/Utilities>
 #include <osgModeling/Subdivision>
 
-osg::ref_ptr<osg::Geode> createSubd( osg::Drawable* drawable, int method, int level )
+osg::ref_ptr<osg::Geode> createSubd( osg::Drawable* drawable, int method, int level, bool halfEdges, bool parallel,
+                                      float angle, unsigned int maxFaces )
 {
     osg::ref_ptr<osg::Geode> geode = new osg::Geode;
 
@@ -39,20 +40,25 @@ osg::ref_ptr<osg::Geode> createSubd( osg::Drawable* drawable, int method, int le
         methodName = "Sqrt(3)";
         subd = new osgModeling::Sqrt3Subdivision( level );
     }
+    subd->setParallel( parallel );
+    subd->setMaxFaces( maxFaces );
+    if ( angle>0.0f ) subd->setCriterion( new osgModeling::CurvatureCriterion(osg::DegreesToRadians(angle)) );
 
     std::cout << "*** Constructing the polygon mesh ..." << std::endl;
     osg::Timer_t t1 = osg::Timer::instance()->tick();
 
     osg::Geometry* geom = dynamic_cast<osg::Geometry*>( drawable );
-    osg::ref_ptr<osgModeling::PolyMesh> mesh = new osgModeling::PolyMesh( *geom );
+    osg::ref_ptr<osgModeling::PolyMesh> mesh = new osgModeling::PolyMesh( *geom, osg::CopyOp::SHALLOW_COPY,
+        halfEdges ? osgModeling::PolyMesh::HALF_EDGE_TOPOLOGY : osgModeling::PolyMesh::EDGE_MAP_TOPOLOGY );
     geode->addDrawable( mesh.get() );
 
     osg::Timer_t t2 = osg::Timer::instance()->tick();
-    std::cout << "- Edges: " << mesh->_edges.size() << std::endl;
+    if ( halfEdges ) std::cout << "- Edges: " << mesh->getHalfEdgeMesh()->getNumEdges() << std::endl;
+    else std::cout << "- Edges: " << mesh->_edges.size() << std::endl;
     std::cout << "- Triangle Faces: " << mesh->_faces.size() << std::endl;
     std::cout << "- Constructing Time: " << osg::Timer::instance()->delta_s( t1, t2 ) << "s" << std::endl;
 
-    if ( mesh->_faces.size()>2000 )
+    if ( !halfEdges && method && mesh->_faces.size()>2000 )
     {
         std::cout << "It needs a long time operating on thousands of faces. Maybe not necessary to subdivide such a fine model?" << std::endl;
         return geode;
@@ -68,13 +74,143 @@ osg::ref_ptr<osg::Geode> createSubd( osg::Drawable* drawable, int method, int le
     tsv.stripify( *mesh );
 
     t2 = osg::Timer::instance()->tick();
-    std::cout << "- Subdividing Edges: " << mesh->_edges.size() << std::endl;
+    if ( halfEdges ) std::cout << "- Subdividing Edges: " << mesh->getHalfEdgeMesh()->getNumEdges() << std::endl;
+    else std::cout << "- Subdividing Edges: " << mesh->_edges.size() << std::endl;
     std::cout << "- Subdividing Faces: " << mesh->_faces.size() << std::endl;
     std::cout << "- Subdividing Time Spend: " << osg::Timer::instance()->delta_s( t1, t2 ) << "s" << std::endl;
 
     return geode;
 }
 
+osg::ref_ptr<osg::Geode> createLimitSurface( osg::Drawable* drawable, int level, bool parallel )
+{
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    osg::Geometry* geom = dynamic_cast<osg::Geometry*>( drawable );
+    osg::ref_ptr<osgModeling::PolyMesh> mesh = new osgModeling::PolyMesh( *geom, osg::CopyOp::SHALLOW_COPY,
+        osgModeling::PolyMesh::HALF_EDGE_TOPOLOGY );
+    osg::Vec3Array* controls = dynamic_cast<osg::Vec3Array*>( mesh->getVertexArray() );
+
+    std::cout << "*** Creating Loop stencils of level " << level << " ..." << std::endl;
+    osg::Timer_t t1 = osg::Timer::instance()->tick();
+    osg::ref_ptr<osgModeling::LoopSubdivision> subd = new osgModeling::LoopSubdivision( level );
+    osg::ref_ptr<osgModeling::SubdivisionStencils> stencils = subd->createStencils( mesh.get() );
+    if ( !stencils.valid() ) return geode;
+
+    osg::Timer_t t2 = osg::Timer::instance()->tick();
+    std::cout << "- Vertices: " << stencils->getNumVertices() << std::endl;
+    std::cout << "- Triangle Faces: " << stencils->getNumFaces() << std::endl;
+    std::cout << "- Creating Time: " << osg::Timer::instance()->delta_s( t1, t2 ) << "s" << std::endl;
+
+    // Only the stencil passes are needed when control vertices are changed later.
+    osgModeling::TaskPool* pool = parallel ? osgModeling::TaskPool::instance() : NULL;
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
+    t1 = osg::Timer::instance()->tick();
+    stencils->computePositions( controls, vertices.get(), true, pool );
+    stencils->computeNormals( controls, normals.get(), pool );
+    t2 = osg::Timer::instance()->tick();
+    std::cout << "- Evaluating Time: " << osg::Timer::instance()->delta_s( t1, t2 ) << "s" << std::endl;
+
+    const osgModeling::SubdivisionStencils::IndexList& indices = stencils->getFaceIndices();
+    osg::ref_ptr<osg::Geometry> surface = new osg::Geometry;
+    surface->setVertexArray( vertices.get() );
+    surface->setNormalArray( normals.get() );
+    surface->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    surface->addPrimitiveSet( new osg::DrawElementsUInt(osg::PrimitiveSet::TRIANGLES, indices.begin(), indices.end()) );
+    geode->addDrawable( surface.get() );
+    return geode;
+}
+
+/** Create a bumpy open mesh for checking stencils, with a grid whose borders have corners of 1 and 2 faces and
+ * other border vertices of 3 faces, and a fan of 7 faces around a border vertex.
+ */
+osg::ref_ptr<osg::Geometry> createCheckMesh()
+{
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
+    osg::ref_ptr<osg::DrawElementsUInt> triangles = new osg::DrawElementsUInt( osg::PrimitiveSet::TRIANGLES );
+    const unsigned int gridSize = 6;
+    for ( unsigned int j=0; j<=gridSize; ++j )
+    {
+        for ( unsigned int i=0; i<=gridSize; ++i )
+            vertices->push_back( osg::Vec3(i, j, 0.4f*sinf(i*1.3f)*cosf(j*0.9f)) );
+    }
+    for ( unsigned int j=0; j<gridSize; ++j )
+    {
+        for ( unsigned int i=0; i<gridSize; ++i )
+        {
+            unsigned int v = j*(gridSize+1) + i;
+            triangles->push_back( v ); triangles->push_back( v+1 ); triangles->push_back( v+gridSize+2 );
+            triangles->push_back( v ); triangles->push_back( v+gridSize+2 ); triangles->push_back( v+gridSize+1 );
+        }
+    }
+
+    const unsigned int fanSize = 7;
+    unsigned int center = vertices->size();
+    vertices->push_back( osg::Vec3(3.0f, -4.0f, 0.3f) );
+    for ( unsigned int i=0; i<=fanSize; ++i )
+    {
+        float angle = osg::PI*i/fanSize;
+        vertices->push_back( osg::Vec3(3.0f+2.0f*cosf(angle), -4.0f+2.0f*sinf(angle), 0.5f*sinf(angle*3.0f)) );
+        if ( i>0 )
+        {
+            triangles->push_back( center ); triangles->push_back( center+i ); triangles->push_back( center+i+1 );
+        }
+    }
+
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    geom->setVertexArray( vertices.get() );
+    geom->addPrimitiveSet( triangles.get() );
+    return geom;
+}
+
+/** Check that repeated refinement of Loop stencils converges to their limit stencils. Original vertices come first
+ * in every level, so their refined positions should approach the limit positions of level 0, while limit
+ * positions and normals computed on any level should stay the same.
+ */
+bool checkLimitStencils( unsigned int maxLevel )
+{
+    osg::ref_ptr<osg::Geometry> geom = createCheckMesh();
+    osg::ref_ptr<osgModeling::PolyMesh> mesh = new osgModeling::PolyMesh( *geom, osg::CopyOp::SHALLOW_COPY,
+        osgModeling::PolyMesh::HALF_EDGE_TOPOLOGY );
+    osg::Vec3Array* controls = dynamic_cast<osg::Vec3Array*>( mesh->getVertexArray() );
+
+    std::cout << "*** Checking Loop limit stencils of " << controls->size() << " vertices ..." << std::endl;
+    osg::ref_ptr<osg::Vec3Array> limits0, normals0;
+    float firstDistance = 0.0f, lastDistance = 0.0f, maxLimitChange = 0.0f, minNormalDot = 1.0f;
+    for ( unsigned int level=0; level<=maxLevel; ++level )
+    {
+        osg::ref_ptr<osgModeling::LoopSubdivision> subd = new osgModeling::LoopSubdivision( level );
+        osg::ref_ptr<osgModeling::SubdivisionStencils> stencils = subd->createStencils( mesh.get() );
+        if ( !stencils.valid() ) return false;
+
+        osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array;
+        osg::ref_ptr<osg::Vec3Array> limits = new osg::Vec3Array;
+        osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array;
+        stencils->computePositions( controls, vertices.get(), false );
+        stencils->computePositions( controls, limits.get(), true );
+        stencils->computeNormals( controls, normals.get() );
+        if ( !level )
+        {
+            limits0 = limits;
+            normals0 = normals;
+        }
+
+        float distance = 0.0f;
+        for ( unsigned int i=0; i<limits0->size(); ++i )
+        {
+            distance = osg::maximum( distance, ((*vertices)[i]-(*limits0)[i]).length() );
+            maxLimitChange = osg::maximum( maxLimitChange, ((*limits)[i]-(*limits0)[i]).length() );
+            minNormalDot = osg::minimum( minNormalDot, (*normals)[i]*(*normals0)[i] );
+        }
+        if ( level==1 ) firstDistance = distance;
+        lastDistance = distance;
+        std::cout << "- Level " << level << ": Distance to the limit " << distance << std::endl;
+    }
+    std::cout << "- Largest change of limit positions: " << maxLimitChange << std::endl;
+    std::cout << "- Smallest dot product of limit normals: " << minNormalDot << std::endl;
+    return lastDistance<0.1f*firstDistance && maxLimitChange<1e-4f && minNormalDot>0.999f;
+}
+
 int main( int argc, char** argv )
 {
     osg::ArgumentParser arguments( &argc, argv );
@@ -83,6 +219,12 @@ int main( int argc, char** argv )
     arguments.getApplicationUsage()->setCommandLineUsage( arguments.getApplicationName()+" [options] filename ..." );
     arguments.getApplicationUsage()->addCommandLineOption( "--method", "Set a subdivision algorithm, 'loop' and 'sqrt3' available at present." );
     arguments.getApplicationUsage()->addCommandLineOption( "--level", "Set level of the subdivision operation." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--halfedge", "Use the half-edge topology instead of the edge map." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--parallel", "Compute new points and faces with the task pool." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--adaptive <angle>", "Only refine faces bending more than the angle in degrees to neighbors." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--maxfaces <num>", "Set maximum number of faces of the result." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--limit", "Evaluate the Loop limit surface of the level with stencils." );
+    arguments.getApplicationUsage()->addCommandLineOption( "--check", "Check that Loop stencils of increasing levels converge to the limit, up to the level." );
     arguments.getApplicationUsage()->addCommandLineOption( "-h or --help","Display help documents." );
 
     if ( arguments.read("-h") || arguments.read("--help") )
@@ -94,6 +236,14 @@ int main( int argc, char** argv )
 
     int method, level;
     std::string methodName;
+    bool halfEdges = arguments.read("--halfedge");
+    bool parallel = arguments.read("--parallel");
+    bool limit = arguments.read("--limit");
+    bool check = arguments.read("--check");
+    float angle = 0.0f;
+    unsigned int maxFaces = 0;
+    arguments.read( "--adaptive", angle );
+    arguments.read( "--maxfaces", maxFaces );
     if ( !arguments.read("--level", level) )
         level = 2;
     if ( !arguments.read("--method", methodName) )
@@ -103,6 +253,13 @@ int main( int argc, char** argv )
     else
         method = 0;
 
+    if ( check )
+    {
+        if ( checkLimitStencils(level) ) return 0;
+        std::cout << "Refined vertices don't converge to the limit stencils." << std::endl;
+        return 1;
+    }
+
     osg::ref_ptr<osg::Group> group = dynamic_cast<osg::Group*>( osgDB::readNodeFiles(arguments) );
     if ( !group.valid() || !group->getNumChildren() )
         group = dynamic_cast<osg::Group*>( osgDB::readNodeFile("./pawn.osg") );
@@ -120,6 +277,9 @@ int main( int argc, char** argv )
     }
 
     osgViewer::Viewer viewer;
-    viewer.setSceneData( createSubd(geode->getDrawable(0), method, level).get() );
+    if ( limit )
+        viewer.setSceneData( createLimitSurface(geode->getDrawable(0), level, parallel).get() );
+    else
+        viewer.setSceneData( createSubd(geode->getDrawable(0), method, level, halfEdges, parallel, angle, maxFaces).get() );
     return viewer.run();
 }
@@ -84,6 +84,76 @@ double BezierCurve::bernstein( int k, int i, double u )
     return basis;
 }
 
+void BezierCurve::deCasteljau( osg::Vec3d* pts, unsigned int k, double u, osg::Vec3d& point,
+                               osg::Vec3d* firstDer, osg::Vec3d* secondDer )
+{
+    if ( firstDer ) firstDer->set( 0.0, 0.0, 0.0 );
+    if ( secondDer ) secondDer->set( 0.0, 0.0, 0.0 );
+    for ( unsigned int r=1; r<=k; ++r )
+    {
+        // Derivatives come from differences of the last 2 levels before the point.
+        if ( secondDer && r+1==k ) *secondDer = (pts[2] - pts[1]*2.0 + pts[0]) * double(k*(k-1));
+        if ( firstDer && r==k ) *firstDer = (pts[1] - pts[0]) * double(k);
+        for ( unsigned int j=0; j<=k-r; ++j )
+            pts[j] = pts[j]*(1.0-u) + pts[j+1]*u;
+    }
+    point = pts[0];
+}
+
+// Evaluates points of a multi-segment curve with derivatives in [begin, end) of the parameter list.
+struct EvaluateBezierCurvePass
+{
+    const osg::Vec3Array& _ctrlPts;
+    unsigned int _degree, _segments;
+    const double* _params;
+    osg::Vec3 *_points, *_firstDers, *_secondDers;
+
+    EvaluateBezierCurvePass( const osg::Vec3Array& ctrlPts, unsigned int degree, unsigned int segments,
+                             const double* params, osg::Vec3* points, osg::Vec3* firstDers, osg::Vec3* secondDers ):
+        _ctrlPts(ctrlPts), _degree(degree), _segments(segments), _params(params),
+        _points(points), _firstDers(firstDers), _secondDers(secondDers) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        osg::Vec3d localBuffer[16];
+        std::vector<osg::Vec3d> heapBuffer;
+        osg::Vec3d* pts = localBuffer;
+        if ( _degree>=16 )
+        {
+            heapBuffer.resize( _degree+1 );
+            pts = &(heapBuffer.front());
+        }
+
+        // Derivatives of segment parameters are scaled to the whole curve.
+        double scale = (double)_segments;
+        for ( unsigned int i=begin; i<end; ++i )
+        {
+            double x = _params[i] * scale;
+            unsigned int segment = x>0.0 ? osg::minimum((unsigned int)x, _segments-1) : 0;
+            for ( unsigned int k=0; k<=_degree; ++k )
+                pts[k] = _ctrlPts[segment*_degree+k];
+
+            osg::Vec3d point, firstDer, secondDer;
+            BezierCurve::deCasteljau( pts, _degree, x-segment, point, _firstDers ? &firstDer : 0, _secondDers ? &secondDer : 0 );
+            _points[i] = point;
+            if ( _firstDers ) _firstDers[i] = firstDer * scale;
+            if ( _secondDers ) _secondDers[i] = secondDer * (scale*scale);
+        }
+    }
+};
+
+bool BezierCurve::evaluate( const double* params, unsigned int num, osg::Vec3* points,
+                            osg::Vec3* firstDers, osg::Vec3* secondDers, TaskPool* pool, unsigned int grainSize ) const
+{
+    if ( !_ctrlPts || !_degree || (num && (!params || !points)) ) return false;
+    if ( _ctrlPts->size()<_degree+1 ) return false;
+
+    EvaluateBezierCurvePass pass( *_ctrlPts, _degree, (_ctrlPts->size()-1)/_degree,
+        params, points, firstDers, secondDers );
+    TaskPool::parallelFor( pass, num, pool, grainSize );
+    return true;
+}
+
 void BezierCurve::updateImplementation()
 {
     if ( !_ctrlPts ) return;
@@ -149,6 +149,79 @@ void BezierSurface::updateImplementation()
     dirtyDisplayList();
 }
 
+// Evaluates points of a surface with partial derivatives and normals in [begin, end) of the parameter list.
+struct EvaluateBezierSurfacePass
+{
+    const osg::Vec3Array& _ctrlPts;
+    unsigned int _degreeU, _degreeV;
+    const double *_u, *_v;
+    osg::Vec3 *_points, *_uDers, *_vDers, *_normals;
+
+    EvaluateBezierSurfacePass( const osg::Vec3Array& ctrlPts, unsigned int degreeU, unsigned int degreeV,
+                               const double* u, const double* v,
+                               osg::Vec3* points, osg::Vec3* uDers, osg::Vec3* vDers, osg::Vec3* normals ):
+        _ctrlPts(ctrlPts), _degreeU(degreeU), _degreeV(degreeV), _u(u), _v(v),
+        _points(points), _uDers(uDers), _vDers(vDers), _normals(normals) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        // Working points of each row, and the resulting row points & V derivatives.
+        unsigned int orderU=_degreeU+1, orderV=_degreeV+1;
+        bool needVDers = _vDers || _normals;
+        osg::Vec3d localBuffer[16*3];
+        std::vector<osg::Vec3d> heapBuffer;
+        osg::Vec3d* pts = localBuffer;
+        osg::Vec3d* rowPts = localBuffer + 16;
+        osg::Vec3d* rowDers = localBuffer + 32;
+        if ( orderU>16 || orderV>16 )
+        {
+            heapBuffer.resize( orderV+2*orderU );
+            pts = &(heapBuffer.front());
+            rowPts = pts + orderV;
+            rowDers = rowPts + orderU;
+        }
+
+        for ( unsigned int i=begin; i<end; ++i )
+        {
+            // Evaluate every row in V, and then the curve of row points in U.
+            unsigned int index = 0;
+            for ( unsigned int k=0; k<orderU; ++k )
+            {
+                for ( unsigned int l=0; l<orderV; ++l, ++index )
+                    pts[l] = _ctrlPts[index];
+                BezierCurve::deCasteljau( pts, _degreeV, _v[i], rowPts[k], needVDers ? &(rowDers[k]) : 0 );
+            }
+
+            osg::Vec3d point, su, sv;
+            BezierCurve::deCasteljau( rowPts, _degreeU, _u[i], point, (_uDers || _normals) ? &su : 0 );
+            if ( needVDers ) BezierCurve::deCasteljau( rowDers, _degreeU, _u[i], sv );
+
+            _points[i] = point;
+            if ( _uDers ) _uDers[i] = su;
+            if ( _vDers ) _vDers[i] = sv;
+            if ( _normals )
+            {
+                osg::Vec3d normal = su ^ sv;
+                double length = normal.length();
+                if ( length>0.0 ) normal /= length;
+                _normals[i] = normal;
+            }
+        }
+    }
+};
+
+bool BezierSurface::evaluate( const double* u, const double* v, unsigned int num, osg::Vec3* points,
+                              osg::Vec3* uDers, osg::Vec3* vDers, osg::Vec3* normals,
+                              TaskPool* pool, unsigned int grainSize ) const
+{
+    if ( !_ctrlPts || (num && (!u || !v || !points)) ) return false;
+    if ( _ctrlPts->size()<(_degreeU+1)*(_degreeV+1) ) return false;
+
+    EvaluateBezierSurfacePass pass( *_ctrlPts, _degreeU, _degreeV, u, v, points, uDers, vDers, normals );
+    TaskPool::parallelFor( pass, num, pool, grainSize );
+    return true;
+}
+
 void BezierSurface::useDeCasteljau( osg::Vec3Array* result )
 {
     unsigned int m, n;
@@ -15,24 +15,29 @@
 * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-#include <map>
+#include <algorithm>
 #include <osgModeling/Utilities>
 #include <osgModeling/BspTree>
 #include <osgModeling/BoolOperator>
 #include <osgModeling/ModelVisitor>
 #include <osgModeling/NormalVisitor>
+#include <osgModeling/VertexWelder>
 
 using namespace osgModeling;
 
 BoolOperator::BoolOperator( Method m ):
     osg::Object(),
-    _method(m), _operand1(0), _operand2(0)
+    _method(m), _operand1(0), _operand2(0),
+    _parallel(false), _parallelGrainSize(64), _weldTolerance(0.0),
+    _triangulationMode(FAN_TRIANGULATION)
 {
 }
 
 BoolOperator::BoolOperator( const BoolOperator& copy, const osg::CopyOp& copyop ):
     osg::Object(copy,copyop),
-    _method(copy._method), _operand1(copy._operand1), _operand2(copy._operand2)
+    _method(copy._method), _operand1(copy._operand1), _operand2(copy._operand2),
+    _parallel(copy._parallel), _parallelGrainSize(copy._parallelGrainSize), _taskPool(copy._taskPool),
+    _weldTolerance(copy._weldTolerance), _triangulationMode(copy._triangulationMode)
 {
 }
 
@@ -44,14 +49,17 @@ void BoolOperator::setOperands( Model* model1, Model* model2 )
 {
     if ( !model1 || !model2 ) return;
 
+    // Trees created here are only traversed by the operator, so nodes are kept in the arena.
     if ( !model1->getBspTree() )
     {
         model1->setBspTree( new osgModeling::BspTree );
+        model1->getBspTree()->setNodeStorage( BspTree::ARENA_NODES );
         osgModeling::ModelVisitor::buildBSP( *model1 );
     }
     if ( !model2->getBspTree() )
     {
         model2->setBspTree( new osgModeling::BspTree );
+        model2->getBspTree()->setNodeStorage( BspTree::ARENA_NODES );
         osgModeling::ModelVisitor::buildBSP( *model2 );
     }
 
@@ -61,187 +69,560 @@ void BoolOperator::setOperands( Model* model1, Model* model2 )
 bool BoolOperator::output( osg::Geometry* result )
 {
     if ( !_operand1 || !_operand2 ) return false;
-    if ( !_operand1->getRoot() || !_operand2->getRoot() ) return false;
+    if ( !_operand1->valid() || !_operand2->valid() ) return false;
 
-    // Receive data according to the boolean method.
-    BspNode* op1 = _operand1->getRoot();
-    BspNode* op2 = _operand2->getRoot();
-    FaceList op1Faces = _operand1->getFaceList();
-    FaceList op2Faces = _operand2->getFaceList();
+    // Decide which operands are negated according to the boolean method.
+    // Negated trees are traversed in place instead of creating reversed copies.
+    bool negate1 = (_method==BOOL_UNION);
+    bool negate2 = (_method!=BOOL_INTERSECTION);
+
+    // Do intersecting operation of 2 objects.
+    FaceList resultFaces;
+    classifyFaces( _operand2, negate2, _operand1->getFaceList(), negate1, true, _method!=BOOL_INTERSECTION, resultFaces );
+    classifyFaces( _operand1, negate1, _operand2->getFaceList(), negate2, false, _method==BOOL_UNION, resultFaces );
+
+    // Do post operations.
     if ( _method==BOOL_UNION )
     {
-        op1 = BspTree::reverseBspNode( _operand1->getRoot() );
-        op1Faces = BspTree::reverseFaces( _operand1->getFaceList() );
-        op2 = BspTree::reverseBspNode( _operand2->getRoot() );
-        op2Faces = BspTree::reverseFaces( _operand2->getFaceList() );
+        for ( FaceList::iterator itr=resultFaces.begin(); itr!=resultFaces.end(); ++itr )
+            std::reverse( itr->_points.begin(), itr->_points.end() );
     }
-    else if ( _method==BOOL_DIFFERENCE )
+
+    convertFacesToGeometry( resultFaces, result, _weldTolerance, _triangulationMode );
+    return true;
+}
+
+/** Build a triangle fan of a polygon. Points are used in order if 'indices' is NULL. */
+static void buildTriangleFan( const unsigned int* indices, unsigned int size, std::vector<unsigned int>& triangles )
+{
+    for ( unsigned int i=2; i<size; ++i )
     {
-        op2 = BspTree::reverseBspNode( _operand2->getRoot() );
-        op2Faces = BspTree::reverseFaces( _operand2->getFaceList() );
+        triangles.push_back( indices ? indices[0] : 0 );
+        triangles.push_back( indices ? indices[i-1] : i-1 );
+        triangles.push_back( indices ? indices[i] : i );
     }
+}
 
-    // Do intersecting operation of 2 objects.
-    FaceList resultFaces;
-    FaceList::iterator itr;
-    for ( itr=op1Faces.begin(); itr!=op1Faces.end(); ++itr )
+/** An operand of batched operations. */
+struct BatchOperand
+{
+    BspTree* _tree;
+    bool _negated;
+    osg::BoundingBox _bound;
+    const BspTree::FaceBoundTree* _faceBounds;
+};
+
+/** Uniform grid of operand bounding boxes, used to find operands touching a face quickly. */
+class OperandGrid
+{
+public:
+    OperandGrid( const std::vector<BatchOperand>& operands )
     {
-        if ( _operand2->getBound().intersects(itr->getBound()) )
+        // Cells are about the average size of operands, which are usually similar in batched operations.
+        osg::Vec3 averageSize;
+        for ( unsigned int i=0; i<operands.size(); ++i )
+        {
+            _bound.expandBy( operands[i]._bound );
+            averageSize += operands[i]._bound._max - operands[i]._bound._min;
+        }
+        averageSize /= (float)operands.size();
+
+        for ( unsigned int i=0; i<3; ++i )
+        {
+            double extent = _bound._max[i] - _bound._min[i];
+            _size[i] = averageSize[i]>0.0f ? (unsigned int)ceil(extent/averageSize[i]) : 1;
+            _size[i] = osg::clampTo( _size[i], 1u, 64u );
+            _cellSize[i] = extent>0.0 ? extent/_size[i] : 1.0;
+        }
+
+        _cells.resize( _size[0]*_size[1]*_size[2] );
+        for ( unsigned int i=0; i<operands.size(); ++i )
         {
-            FaceList pos, neg, coinSame, coinNeg;
-            _operand2->analyzeFace( op2, *itr, pos, neg, coinSame, coinNeg );
-            resultFaces.insert( resultFaces.end(), neg.begin(), neg.end() );
-            resultFaces.insert( resultFaces.end(), coinSame.begin(), coinSame.end() );
+            unsigned int minCell[3], maxCell[3];
+            getCellRange( operands[i]._bound, minCell, maxCell );
+            for ( unsigned int x=minCell[0]; x<=maxCell[0]; ++x )
+                for ( unsigned int y=minCell[1]; y<=maxCell[1]; ++y )
+                    for ( unsigned int z=minCell[2]; z<=maxCell[2]; ++z )
+                        _cells[(z*_size[1]+y)*_size[0]+x].push_back( i );
         }
-        else if ( _method!=BOOL_INTERSECTION )
+    }
+
+    /** Find operands whose cells overlap the bounding box, in ascending order. */
+    void query( const osg::BoundingBox& bound, std::vector<unsigned int>& result ) const
+    {
+        result.clear();
+        if ( !_bound.intersects(bound) ) return;
+
+        unsigned int minCell[3], maxCell[3];
+        getCellRange( bound, minCell, maxCell );
+        for ( unsigned int x=minCell[0]; x<=maxCell[0]; ++x )
         {
-            resultFaces.push_back( *itr );
+            for ( unsigned int y=minCell[1]; y<=maxCell[1]; ++y )
+            {
+                for ( unsigned int z=minCell[2]; z<=maxCell[2]; ++z )
+                {
+                    const std::vector<unsigned int>& cell = _cells[(z*_size[1]+y)*_size[0]+x];
+                    result.insert( result.end(), cell.begin(), cell.end() );
+                }
+            }
         }
+        std::sort( result.begin(), result.end() );
+        result.erase( std::unique(result.begin(), result.end()), result.end() );
     }
-    for ( itr=op2Faces.begin(); itr!=op2Faces.end(); ++itr )
+
+    /** Split a face of an operand along cell borders recursively, so that every tile covers only one cell.
+     * Tiles not touching cells of other operands are left as they are, as no operand will cut them.
+     */
+    void splitByCells( const BoolOperator::BspFace& face, const osg::BoundingBox& bound, unsigned int owner,
+                       BoolOperator::FaceList& tiles, std::vector<osg::BoundingBox>& tileBounds ) const
     {
-        if ( _operand1->getBound().intersects(itr->getBound()) )
+        unsigned int minCell[3], maxCell[3], axis=0;
+        getCellRange( bound, minCell, maxCell );
+        if ( !hasOtherOperands(minCell, maxCell, owner) )
+        {
+            tiles.push_back( face );
+            tileBounds.push_back( bound );
+            return;
+        }
+
+        for ( unsigned int i=1; i<3; ++i )
         {
-            FaceList pos, neg, coinSame, coinNeg;
-            _operand1->analyzeFace( op1, *itr, pos, neg, coinSame, coinNeg );
-            resultFaces.insert( resultFaces.end(), neg.begin(), neg.end() );
-            //resultFaces.insert( resultFaces.end(), coinSame.begin(), coinSame.end() );
+            if ( maxCell[i]-minCell[i]>maxCell[axis]-minCell[axis] ) axis = i;
         }
-        else if ( _method==BOOL_UNION )
+
+        if ( maxCell[axis]>minCell[axis] )
         {
-            resultFaces.push_back( *itr );
+            // Bisect at the middle cell border.
+            osg::Vec3 normal;
+            normal[axis] = 1.0f;
+            double border = _bound._min[axis] + _cellSize[axis]*((minCell[axis]+maxCell[axis]+1)/2);
+            BoolOperator::BspFace pos, neg;
+            if ( BspTree::splitFace(osg::Plane(normal, -border), face, pos, neg)==BspTree::CROSS_FACE )
+            {
+                splitByCells( pos, pos.getBound(), owner, tiles, tileBounds );
+                splitByCells( neg, neg.getBound(), owner, tiles, tileBounds );
+                return;
+            }
         }
+        tiles.push_back( face );
+        tileBounds.push_back( bound );
     }
 
-    // Do post operations.
-    if ( _method==BOOL_UNION )
+protected:
+    bool hasOtherOperands( const unsigned int* minCell, const unsigned int* maxCell, unsigned int self ) const
     {
-        resultFaces = BspTree::reverseFaces( resultFaces );
-        BspTree::destroyBspNode( op1 );
-        BspTree::destroyBspNode( op2 );
+        for ( unsigned int x=minCell[0]; x<=maxCell[0]; ++x )
+        {
+            for ( unsigned int y=minCell[1]; y<=maxCell[1]; ++y )
+            {
+                for ( unsigned int z=minCell[2]; z<=maxCell[2]; ++z )
+                {
+                    const std::vector<unsigned int>& cell = _cells[(z*_size[1]+y)*_size[0]+x];
+                    for ( unsigned int i=0; i<cell.size(); ++i )
+                    {
+                        if ( cell[i]!=self ) return true;
+                    }
+                }
+            }
+        }
+        return false;
     }
-    else if ( _method==BOOL_DIFFERENCE )
+
+    void getCellRange( const osg::BoundingBox& bound, unsigned int* minCell, unsigned int* maxCell ) const
     {
-        BspTree::destroyBspNode( op2 );
+        for ( unsigned int i=0; i<3; ++i )
+        {
+            double minValue = (bound._min[i]-_bound._min[i]) / _cellSize[i];
+            double maxValue = (bound._max[i]-_bound._min[i]) / _cellSize[i];
+            minCell[i] = minValue>0.0 ? osg::minimum((unsigned int)minValue, _size[i]-1) : 0;
+            maxCell[i] = maxValue>0.0 ? osg::minimum((unsigned int)maxValue, _size[i]-1) : 0;
+        }
     }
 
-    convertFacesToGeometry( resultFaces, result );
-    return true;
-}
+    osg::BoundingBox _bound;
+    unsigned int _size[3];
+    double _cellSize[3];
+    std::vector< std::vector<unsigned int> > _cells;
+};
 
-bool BoolOperator::convertFacesToGeometry( FaceList faces, osg::Geometry* geom )
+/** Clip a tile of a face by candidate operands in order, and append the parts belonging to the result. */
+static void clipBatchTile( const std::vector<BatchOperand>& operands, const std::vector<unsigned int>& candidates,
+                           unsigned int self, BoolOperator::BspFace& tile, const osg::BoundingBox& tileBound,
+                           BoolOperator::FaceList& result )
 {
-    if ( !faces.size() || !geom ) return false;
-    std::map<osg::Vec3, unsigned int> verticesMap;
-
-    osg::ref_ptr<osg::Vec3Array> vertics = new osg::Vec3Array;
-    osg::ref_ptr<osg::DrawElementsUInt> indices = new osg::DrawElementsUInt( osg::PrimitiveSet::TRIANGLES, 0 );
-
-    unsigned int i, index=0, firstIndex=0, lastIndex=0;
-    for ( FaceList::iterator itr=faces.begin();
-        itr!=faces.end();
-        ++itr )
+    // Parts of the tile and their bounding boxes. Parts not touching an operand stay where they are.
+    BoolOperator::FaceList parts( 1, BoolOperator::BspFace() );
+    std::vector<osg::BoundingBox> partBounds( 1, tileBound );
+    parts[0]._points.swap( tile._points );
+    for ( unsigned int i=0; i<candidates.size() && parts.size(); ++i )
     {
-        BspFace f = *itr;
-        unsigned int size=f._points.size();
-        for ( i=0; i<size; ++i )
+        const BatchOperand& operand = operands[candidates[i]];
+        if ( candidates[i]==self ) continue;
+
+        unsigned int numParts=parts.size(), numKept=0;
+        for ( unsigned int j=0; j<numParts; ++j )
         {
-            if ( i>2 )
+            if ( !operand._bound.intersects(partBounds[j]) )
             {
-                indices->push_back( firstIndex );
-                indices->push_back( lastIndex );
+                if ( !operand._negated ) continue;
             }
-
-            if ( verticesMap.find(f[i])==verticesMap.end() )
+            else
             {
-                verticesMap[ f[i] ] = index;
-                vertics->push_back( f[i] );
-                indices->push_back( index++ );
+                // A part far away from all faces of the operand is kept or discarded by a single point query.
+                BspTree::FaceClassify type = BspTree::INVALID_FACE;
+                if ( !operand._faceBounds->intersects(partBounds[j]) )
+                    type = operand._tree->classifyPoint( partBounds[j].center(), operand._negated );
+                if ( type==BspTree::POSITIVE_FACE ) continue;
+
+                if ( type!=BspTree::NEGATIVE_FACE )
+                {
+                    BoolOperator::FaceList pos, neg, coinSame, coinNeg;
+                    operand._tree->analyzeFace( parts[j], pos, neg, coinSame, coinNeg, operand._negated );
+                    if ( self<candidates[i] ) neg.insert( neg.end(), coinSame.begin(), coinSame.end() );
+                    for ( BoolOperator::FaceList::iterator itr=neg.begin(); itr!=neg.end(); ++itr )
+                    {
+                        parts.push_back( BoolOperator::BspFace() );
+                        parts.back()._points.swap( itr->_points );
+                        partBounds.push_back( parts.back().getBound() );
+                    }
+                    continue;
+                }
             }
-            else
+
+            if ( numKept!=j )
             {
-                indices->push_back( verticesMap[ f[i] ] );
+                parts[numKept]._points.swap( parts[j]._points );
+                partBounds[numKept] = partBounds[j];
             }
+            numKept++;
+        }
 
-            if ( !i ) firstIndex = indices->back();
-            lastIndex = indices->back();
+        // Move new parts after kept ones.
+        for ( unsigned int j=numParts; j<parts.size(); ++j, ++numKept )
+        {
+            if ( numKept==j ) continue;
+            parts[numKept]._points.swap( parts[j]._points );
+            partBounds[numKept] = partBounds[j];
         }
+        parts.resize( numKept );
+        partBounds.resize( numKept );
     }
+    result.insert( result.end(), parts.begin(), parts.end() );
+}
 
-    geom->removePrimitiveSet( 0, geom->getPrimitiveSetList().size() );
-    geom->addPrimitiveSet( indices.get() );
-    geom->setVertexArray( vertics.get() );
-    geom->setTexCoordArray( 0, NULL );	// TEMP
-    NormalVisitor::buildNormal( *geom );
-    geom->dirtyDisplayList();
-    return true;
+/** Clip a range of tiles by operands touching them. */
+static void clipBatchTiles( const std::vector<BatchOperand>& operands, const OperandGrid& grid,
+                            const std::vector<unsigned int>& unnegated, const std::vector<unsigned int>& owners,
+                            BoolOperator::FaceList& tiles, const std::vector<osg::BoundingBox>& tileBounds,
+                            unsigned int begin, unsigned int end, BoolOperator::FaceList& result )
+{
+    std::vector<unsigned int> candidates;
+    for ( unsigned int i=begin; i<end; ++i )
+    {
+        // Operands not negated are always checked, as tiles outside them must be discarded.
+        grid.query( tileBounds[i], candidates );
+        candidates.insert( candidates.end(), unnegated.begin(), unnegated.end() );
+        std::sort( candidates.begin(), candidates.end() );
+        candidates.erase( std::unique(candidates.begin(), candidates.end()), candidates.end() );
+        clipBatchTile( operands, candidates, owners[i], tiles[i], tileBounds[i], result );
+    }
 }
 
-void BoolOperator::triangulate( BspFace face, osg::Vec3 normal, FaceList& flist )
+struct ClipBatchTask : public TaskPool::Task
 {
-    unsigned int size=face._points.size();
-    if ( size==3 )
+    const std::vector<BatchOperand>& _operands;
+    const OperandGrid& _grid;
+    const std::vector<unsigned int>& _unnegated;
+    const std::vector<unsigned int>& _owners;
+    BoolOperator::FaceList& _tiles;
+    const std::vector<osg::BoundingBox>& _tileBounds;
+    unsigned int _begin, _end;
+    BoolOperator::FaceList& _result;
+
+    ClipBatchTask( const std::vector<BatchOperand>& operands, const OperandGrid& grid,
+                   const std::vector<unsigned int>& unnegated, const std::vector<unsigned int>& owners,
+                   BoolOperator::FaceList& tiles, const std::vector<osg::BoundingBox>& tileBounds,
+                   unsigned int begin, unsigned int end, BoolOperator::FaceList& result ):
+        _operands(operands), _grid(grid), _unnegated(unnegated), _owners(owners),
+        _tiles(tiles), _tileBounds(tileBounds), _begin(begin), _end(end), _result(result)
+    {}
+
+    virtual void run()
+    { clipBatchTiles( _operands, _grid, _unnegated, _owners, _tiles, _tileBounds, _begin, _end, _result ); }
+};
+
+bool BoolOperator::computeBatch( BspTree* base, const BspTreeList& operands, FaceList& resultFaces )
+{
+    if ( !base || !base->valid() ) return false;
+    for ( BspTreeList::const_iterator itr=operands.begin(); itr!=operands.end(); ++itr )
     {
-        flist.push_back( face );
-        return;
+        if ( !(*itr) || !(*itr)->valid() ) return false;
+    }
+
+    // The result is the intersection of all operands, some of which are negated according to the method.
+    // A face of an operand belongs to the result if it is inside all other operands. Clipping a face by the
+    // operands one after another doesn't depend on other faces, so no intermediate BSP tree is needed,
+    // and only operands touching the face are used.
+    std::vector<BatchOperand> batch( operands.size()+1 );
+    std::vector<unsigned int> unnegated;
+    for ( unsigned int i=0; i<batch.size(); ++i )
+    {
+        batch[i]._tree = i ? operands[i-1] : base;
+        batch[i]._negated = i ? (_method!=BOOL_INTERSECTION) : (_method==BOOL_UNION);
+        batch[i]._bound = batch[i]._tree->getBound();
+        batch[i]._faceBounds = batch[i]._tree->getFaceBoundTree();
+        if ( !batch[i]._negated ) unnegated.push_back( i );
     }
+    OperandGrid grid( batch );
 
-    unsigned int i0, i1, i2;
-    for ( i0=0, i1=1, i2=2; i0<size;
-        i0++, i1=(i1+1)%size, i2=(i2+1)%size )
+    // Collect faces of all operands, reversed if the operands are negated. Large faces near other operands are
+    // split into tiles along grid cells, so every tile is only clipped by operands nearby. Otherwise splitting
+    // planes of an operand would cut the whole face and produce long slivers. Faces away from other operands
+    // are kept whole.
+    FaceList tiles;
+    std::vector<osg::BoundingBox> tileBounds;
+    std::vector<unsigned int> owners;
+    for ( unsigned int i=0; i<batch.size(); ++i )
     {
-        if ( checkDiagonal(face, normal, i0, i2) )
+        const FaceList& operandFaces = batch[i]._tree->getFaceList();
+        for ( FaceList::const_iterator itr=operandFaces.begin(); itr!=operandFaces.end(); ++itr )
         {
-            BspFace newFace;
-            newFace.addPoint( face[i0] );
-            newFace.addPoint( face[i1] );
-            newFace.addPoint( face[i2] );
-            flist.push_back( newFace );
+            BspFace face = *itr;
+            if ( batch[i]._negated ) std::reverse( face._points.begin(), face._points.end() );
 
-            newFace._points = face._points;
-            newFace._points.erase( newFace._points.begin()+i1 );
-            triangulate( newFace, normal, flist );
-            return;
+            // The face is outside operands not touching it, so it's discarded if any of them is not negated.
+            osg::BoundingBox faceBound = face.getBound();
+            bool outside = false;
+            for ( unsigned int j=0; j<unnegated.size() && !outside; ++j )
+                outside = unnegated[j]!=i && !batch[unnegated[j]]._bound.intersects(faceBound);
+            if ( outside ) continue;
+
+            grid.splitByCells( face, faceBound, i, tiles, tileBounds );
+            owners.resize( tiles.size(), i );
+        }
+    }
+
+    unsigned int size = tiles.size();
+    FaceList result;
+    if ( !_parallel || !_parallelGrainSize || size<=_parallelGrainSize )
+    {
+        clipBatchTiles( batch, grid, unnegated, owners, tiles, tileBounds, 0, size, result );
+    }
+    else
+    {
+        unsigned int numChunks = (size+_parallelGrainSize-1) / _parallelGrainSize;
+        std::vector<FaceList> chunkResults( numChunks );
+        TaskPool* pool = getTaskPool();
+        TaskPool::TaskGroup group;
+        for ( unsigned int i=0; i<numChunks; ++i )
+        {
+            pool->spawn( new ClipBatchTask(batch, grid, unnegated, owners, tiles, tileBounds, i*_parallelGrainSize,
+                osg::minimum(size, (i+1)*_parallelGrainSize), chunkResults[i]), &group );
         }
+        pool->wait( &group );
+
+        for ( unsigned int i=0; i<numChunks; ++i )
+            result.insert( result.end(), chunkResults[i].begin(), chunkResults[i].end() );
+    }
+
+    if ( _method==BOOL_UNION )
+    {
+        for ( FaceList::iterator itr=result.begin(); itr!=result.end(); ++itr )
+            std::reverse( itr->_points.begin(), itr->_points.end() );
     }
+    resultFaces.swap( result );
+    return true;
 }
 
-bool BoolOperator::checkDiagonal( BspFace face, osg::Vec3 normal, unsigned int i0, unsigned int ie )
+bool BoolOperator::outputBatch( BspTree* base, const BspTreeList& operands, osg::Geometry* result )
 {
-    unsigned int size = face._points.size();
-    int iPrev, iNext;
-    if ( i0==0 ) iPrev = size-1;
-    else iPrev = i0-1;
-    iNext = (i0+1)%size;
+    FaceList resultFaces;
+    if ( !computeBatch(base, operands, resultFaces) ) return false;
+
+    convertFacesToGeometry( resultFaces, result, _weldTolerance, _triangulationMode );
+    return true;
+}
 
-    // Check if ie-i0 is in a cone formed by iPrev, i0 & iNext.
-    osg::Vec3 vDiff=face[ie]-face[i0], eLeft=face[iPrev]-face[i0], eRight=face[iNext]-face[i0];
-    osg::Vec3 cross=eLeft^eRight, crossLeft=vDiff^eLeft, crossRight=vDiff^eRight;
-    cross.normalize();
-    crossLeft.normalize();
-    crossRight.normalize();
-    if ( equivalent(cross,normal) )
+static void classifyFaceRange( BspTree* tree, bool negateTree, const osg::BoundingBox& bound,
+                               const BspTree::FaceBoundTree& treeFaces,
+                               const BoolOperator::FaceList& faces, bool reverseFaces, unsigned int begin, unsigned int end,
+                               bool keepCoinSame, bool keepOutside, BoolOperator::FaceList& result )
+{
+    for ( unsigned int i=begin; i<end; ++i )
     {
-        if ( !equivalent(crossLeft,cross) && equivalent(crossRight,cross) )
-            return false;
+        BoolOperator::BspFace face = faces[i];
+        if ( reverseFaces ) std::reverse( face._points.begin(), face._points.end() );
+        osg::BoundingBox faceBound = face.getBound();
+        if ( bound.intersects(faceBound) )
+        {
+            // If no face of the tree touches the box of the face, the whole box lies on one side of the surface,
+            // so a single point query decides the face instead of clipping it through every tree level.
+            if ( !treeFaces.intersects(faceBound) )
+            {
+                BspTree::FaceClassify type = tree->classifyPoint( faceBound.center(), negateTree );
+                if ( type==BspTree::NEGATIVE_FACE )
+                {
+                    result.push_back( face );
+                    continue;
+                }
+                else if ( type==BspTree::POSITIVE_FACE )
+                    continue;
+            }
+
+            BoolOperator::FaceList pos, neg, coinSame, coinNeg;
+            tree->analyzeFace( face, pos, neg, coinSame, coinNeg, negateTree );
+            result.insert( result.end(), neg.begin(), neg.end() );
+            if ( keepCoinSame ) result.insert( result.end(), coinSame.begin(), coinSame.end() );
+        }
+        else if ( keepOutside )
+        {
+            result.push_back( face );
+        }
     }
-    else
+}
+
+struct ClassifyFacesTask : public TaskPool::Task
+{
+    BspTree* _tree;
+    bool _negateTree;
+    osg::BoundingBox _bound;
+    const BspTree::FaceBoundTree& _treeFaces;
+    const BoolOperator::FaceList& _faces;
+    bool _reverseFaces;
+    unsigned int _begin, _end;
+    bool _keepCoinSame, _keepOutside;
+    BoolOperator::FaceList& _result;
+
+    ClassifyFacesTask( BspTree* tree, bool negateTree, const osg::BoundingBox& bound,
+                       const BspTree::FaceBoundTree& treeFaces, const BoolOperator::FaceList& faces, bool reverseFaces,
+                       unsigned int begin, unsigned int end, bool keepCoinSame, bool keepOutside,
+                       BoolOperator::FaceList& result ):
+        _tree(tree), _negateTree(negateTree), _bound(bound), _treeFaces(treeFaces), _faces(faces),
+        _reverseFaces(reverseFaces), _begin(begin), _end(end), _keepCoinSame(keepCoinSame), _keepOutside(keepOutside), _result(result)
+    {}
+
+    virtual void run()
     {
-        if ( equivalent(crossLeft,cross) || !equivalent(crossRight,cross) )
-            return false;
+        classifyFaceRange( _tree, _negateTree, _bound, _treeFaces, _faces, _reverseFaces, _begin, _end,
+            _keepCoinSame, _keepOutside, _result );
     }
+};
 
-    // Test if there is intersection with other edges.
-    bool ok;
-    unsigned int j0, j1;
-    for ( j0=0, j1=face._points.size()-1; j0<face._points.size(); j1=j0, j0++ )
+void BoolOperator::classifyFaces( BspTree* tree, bool negateTree, const FaceList& faces, bool reverseFaces,
+                                  bool keepCoinSame, bool keepOutside, FaceList& result )
+{
+    osg::BoundingBox bound = tree->getBound();
+
+    // Face boxes are padded by the plane thickness, so faces touching the surface are always clipped.
+    const BspTree::FaceBoundTree& treeFaces = *tree->getFaceBoundTree();
+    unsigned int size = faces.size();
+    if ( !_parallel || !_parallelGrainSize || size<=_parallelGrainSize )
     {
-        if ( j0!=i0 && j0!=ie && j1!=i0 && j1!=ie )
+        classifyFaceRange( tree, negateTree, bound, treeFaces, faces, reverseFaces, 0, size,
+            keepCoinSame, keepOutside, result );
+        return;
+    }
+
+    // Every chunk has its own result list, and they are appended in order at last.
+    unsigned int numChunks = (size+_parallelGrainSize-1) / _parallelGrainSize;
+    std::vector<FaceList> chunkResults( numChunks );
+    TaskPool* pool = getTaskPool();
+    TaskPool::TaskGroup group;
+    for ( unsigned int i=0; i<numChunks; ++i )
+    {
+        pool->spawn( new ClassifyFacesTask(tree, negateTree, bound, treeFaces, faces, reverseFaces,
+            i*_parallelGrainSize, osg::minimum(size, (i+1)*_parallelGrainSize), keepCoinSame, keepOutside,
+            chunkResults[i]), &group );
+    }
+    pool->wait( &group );
+
+    for ( unsigned int i=0; i<numChunks; ++i )
+        result.insert( result.end(), chunkResults[i].begin(), chunkResults[i].end() );
+}
+
+bool BoolOperator::convertFacesToGeometry( const FaceList& faces, osg::Geometry* geom, double weldTolerance,
+                                           TriangulationMode mode )
+{
+    if ( !faces.size() || !geom ) return false;
+
+    // Most vertices are shared by several faces, so the face number is enough for reserving.
+    VertexWelder welder( weldTolerance, faces.size() );
+    osg::ref_ptr<osg::DrawElementsUInt> indices = new osg::DrawElementsUInt( osg::PrimitiveSet::TRIANGLES, 0 );
+    indices->reserve( faces.size()*3 );
+
+    std::vector<unsigned int> faceIndices, triangles;
+    for ( FaceList::const_iterator itr=faces.begin(); itr!=faces.end(); ++itr )
+    {
+        // Remove points welded with their previous ones.
+        const BspFace& f = *itr;
+        faceIndices.clear();
+        for ( unsigned int i=0; i<f._points.size(); ++i )
+        {
+            unsigned int index = welder.weld( f._points[i] );
+            if ( !faceIndices.size() || faceIndices.back()!=index )
+                faceIndices.push_back( index );
+        }
+        if ( faceIndices.size()>1 && faceIndices.back()==faceIndices.front() )
+            faceIndices.pop_back();
+        if ( faceIndices.size()<3 ) continue;
+
+        triangles.clear();
+        bool clipped = false;
+        if ( mode==EAR_CLIPPING && faceIndices.size()>3 )
+        {
+            clipped = triangulatePolygon( &(welder.getVertexArray()->front()), &(faceIndices.front()), faceIndices.size(),
+                osg::Vec3(), triangles );
+        }
+
+        // Degenerated polygons can't be ear clipped, so fall back to the fan instead of losing them.
+        if ( !clipped )
+        {
+            triangles.clear();
+            buildTriangleFan( &(faceIndices.front()), faceIndices.size(), triangles );
+        }
+
+        // Skip degenerated triangles, whose points are welded together.
+        for ( unsigned int i=0; i+2<triangles.size(); i+=3 )
         {
-            calcIntersect( face[i0], vDiff, face[j0], face[j1]-face[j0], false, &ok );
-            if ( ok ) return false;
+            if ( triangles[i]==triangles[i+1] || triangles[i+1]==triangles[i+2] || triangles[i+2]==triangles[i] )
+                continue;
+            indices->push_back( triangles[i] );
+            indices->push_back( triangles[i+1] );
+            indices->push_back( triangles[i+2] );
         }
     }
 
+    geom->removePrimitiveSet( 0, geom->getPrimitiveSetList().size() );
+    geom->addPrimitiveSet( indices.get() );
+    geom->setVertexArray( welder.getVertexArray() );
+    geom->setTexCoordArray( 0, NULL );	// TEMP
+    NormalVisitor::buildNormal( *geom );
+    geom->dirtyDisplayList();
     return true;
 }
+
+void BoolOperator::triangulate( const BspFace& face, const osg::Vec3& normal, FaceList& flist )
+{
+    unsigned int size=face._points.size();
+    if ( size==3 )
+    {
+        flist.push_back( face );
+        return;
+    }
+    else if ( size<3 ) return;
+
+    std::vector<unsigned int> triangles;
+    if ( !triangulatePolygon(&(face._points.front()), NULL, size, normal, triangles) )
+    {
+        triangles.clear();
+        buildTriangleFan( NULL, size, triangles );
+    }
+    for ( unsigned int i=0; i+2<triangles.size(); i+=3 )
+    {
+        BspFace newFace;
+        newFace.addPoint( face._points[triangles[i]] );
+        newFace.addPoint( face._points[triangles[i+1]] );
+        newFace.addPoint( face._points[triangles[i+2]] );
+        flist.push_back( newFace );
+    }
+}
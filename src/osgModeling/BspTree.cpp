@@ -15,6 +15,7 @@
 * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <OpenThreads/ScopedLock>
 #include <osgModeling/Utilities>
 #include <osgModeling/ModelVisitor>
 #include <osgModeling/BspTree>
@@ -77,33 +78,290 @@ osg::BoundingBox BspTree::BspFace::getBound()
     return bound;
 }
 
+struct BoxCenterLess
+{
+    const std::vector<osg::BoundingBox>& _boxes;
+    unsigned int _axis;
+
+    BoxCenterLess( const std::vector<osg::BoundingBox>& boxes, unsigned int axis ): _boxes(boxes), _axis(axis) {}
+    bool operator()( unsigned int a, unsigned int b ) const
+    { return _boxes[a].center()[_axis] < _boxes[b].center()[_axis]; }
+};
+
+BspTree::FaceBoundTree::FaceBoundTree( const FaceList& faces, double padding ):
+    _padding(padding)
+{
+    unsigned int size = faces.size();
+    if ( !size ) return;
+
+    _boxes.resize( size );
+    _indices.resize( size );
+    for ( unsigned int i=0; i<size; ++i )
+    {
+        BspFace face = faces[i];
+        osg::BoundingBox& box = _boxes[i];
+        box = face.getBound();
+        box._min -= osg::Vec3(padding, padding, padding);
+        box._max += osg::Vec3(padding, padding, padding);
+        _indices[i] = i;
+    }
+    _nodes.reserve( 2*size/s_leafSize+1 );
+    buildNode( 0, size );
+}
+
+bool BspTree::FaceBoundTree::intersects( const osg::BoundingBox& bound ) const
+{
+    if ( _nodes.empty() ) return false;
+
+    std::vector<unsigned int> stack( 1, 0 );
+    while ( !stack.empty() )
+    {
+        const Node& node = _nodes[stack.back()];
+        unsigned int index = stack.back();
+        stack.pop_back();
+        if ( !node._bound.intersects(bound) ) continue;
+
+        if ( node._count )
+        {
+            for ( unsigned int i=node._first; i<node._first+node._count; ++i )
+            {
+                if ( _boxes[_indices[i]].intersects(bound) ) return true;
+            }
+        }
+        else
+        {
+            stack.push_back( node._right );
+            stack.push_back( index+1 );
+        }
+    }
+    return false;
+}
+
+unsigned int BspTree::FaceBoundTree::buildNode( unsigned int begin, unsigned int end )
+{
+    unsigned int index = _nodes.size();
+    _nodes.push_back( Node() );
+
+    osg::BoundingBox bound;
+    for ( unsigned int i=begin; i<end; ++i ) bound.expandBy( _boxes[_indices[i]] );
+    _nodes[index]._bound = bound;
+    if ( end-begin<=s_leafSize )
+    {
+        _nodes[index]._first = begin;
+        _nodes[index]._count = end-begin;
+        return index;
+    }
+
+    osg::Vec3 extent = bound._max - bound._min;
+    unsigned int axis = extent.x()>extent.y() ? (extent.x()>extent.z() ? 0 : 2) : (extent.y()>extent.z() ? 1 : 2);
+    unsigned int middle = (begin+end) / 2;
+    std::nth_element( _indices.begin()+begin, _indices.begin()+middle, _indices.begin()+end,
+        BoxCenterLess(_boxes, axis) );
+
+    _nodes[index]._count = 0;
+    buildNode( begin, middle );
+    unsigned int right = buildNode( middle, end );
+    _nodes[index]._right = right;
+    return index;
+}
+
+/** Points of a face list packed in structure-of-arrays layout, for classifying against planes quickly.
+ * Coordinates are kept in double to give the same distances as osg::Plane::distance().
+ */
+struct PackedFaces
+{
+    std::vector<double> _x, _y, _z;
+    std::vector<unsigned int> _offsets;
+
+    PackedFaces( const BspTree::FaceList& fl )
+    {
+        unsigned int numPoints = 0;
+        for ( BspTree::FaceList::const_iterator itr=fl.begin(); itr!=fl.end(); ++itr )
+            numPoints += itr->_points.size();
+        _x.reserve( numPoints ); _y.reserve( numPoints ); _z.reserve( numPoints );
+        _offsets.reserve( fl.size()+1 );
+
+        _offsets.push_back( 0 );
+        for ( BspTree::FaceList::const_iterator itr=fl.begin(); itr!=fl.end(); ++itr )
+        {
+            for ( BspTree::PointList::const_iterator pitr=itr->_points.begin(); pitr!=itr->_points.end(); ++pitr )
+            {
+                _x.push_back( pitr->x() );
+                _y.push_back( pitr->y() );
+                _z.push_back( pitr->z() );
+            }
+            _offsets.push_back( _x.size() );
+        }
+    }
+};
+
+struct DividerScore
+{
+    double _relation;
+    unsigned int _crossNum;
+
+    DividerScore(): _relation(0.0f), _crossNum(0) {}
+};
+
+/** Count faces on each side of a candidate divider without splitting them.
+ * Classification matches splitFace(): a point is coincident if its distance is within the epsilon.
+ */
+static void scoreDivider( const BspTree::FaceList& fl, const PackedFaces& packed, unsigned int candidate,
+                         double eps, std::vector<unsigned char>& flags, DividerScore& score )
+{
+    const BspTree::BspFace& face = fl[candidate];
+    osg::Plane plane = calcPlane( face._points[0], face._points[1], face._points[2] );
+    const double a=plane[0], b=plane[1], c=plane[2], d=plane[3];
+
+    // Branch-free loop over packed coordinates, which can be vectorized by the compiler.
+    unsigned int numPoints = packed._x.size();
+    flags.resize( numPoints );
+    const double *x=&(packed._x[0]), *y=&(packed._y[0]), *z=&(packed._z[0]);
+    unsigned char* f = &(flags[0]);
+    for ( unsigned int i=0; i<numPoints; ++i )
+    {
+        double dis = a*x[i] + b*y[i] + c*z[i] + d;
+        f[i] = (unsigned char)((dis>eps) | ((!(dis>=-eps))<<1));
+    }
+
+    unsigned int posNum=0, negNum=0, crossNum=0;
+    unsigned int numFaces = packed._offsets.size()-1;
+    for ( unsigned int i=0; i<numFaces; ++i )
+    {
+        if ( i==candidate ) continue;
+
+        unsigned char type = 0;
+        for ( unsigned int j=packed._offsets[i]; j<packed._offsets[i+1]; ++j )
+            type |= f[j];
+
+        switch ( type )
+        {
+        case 3: crossNum++; break;
+        case 1: posNum++; break;
+        case 2: negNum++; break;
+        default: break;
+        }
+    }
+
+    score._relation = 0.0f;
+    if ( posNum>negNum ) score._relation = (double)negNum/(double)posNum;
+    else if ( negNum ) score._relation = (double)posNum/(double)negNum;
+    score._crossNum = crossNum;
+}
+
+struct ScoreDividerTask : public TaskPool::Task
+{
+    const BspTree::FaceList& _faces;
+    const PackedFaces& _packed;
+    const std::vector<unsigned int>& _candidates;
+    std::vector<DividerScore>& _scores;
+    unsigned int _begin, _end;
+    double _epsilon;
+
+    ScoreDividerTask( const BspTree::FaceList& fl, const PackedFaces& packed, const std::vector<unsigned int>& candidates,
+                      std::vector<DividerScore>& scores, unsigned int begin, unsigned int end, double epsilon ):
+        _faces(fl), _packed(packed), _candidates(candidates), _scores(scores), _begin(begin), _end(end), _epsilon(epsilon)
+    {}
+
+    virtual void run()
+    {
+        std::vector<unsigned char> flags;
+        for ( unsigned int c=_begin; c<_end; ++c )
+            scoreDivider( _faces, _packed, _candidates[c], _epsilon, flags, _scores[c] );
+    }
+};
+
 BspTree::BspTree( unsigned int numSearchBestDivider ):
-    osg::Object(), _root(0), _numSearchBestDivider(numSearchBestDivider)
+    osg::Object(), _root(0), _numSearchBestDivider(numSearchBestDivider),
+    _epsilon(1e-6), _nodeStorage(POINTER_NODES), _parallelBuild(false), _parallelGrainSize(256),
+    _coplanarCacheLimit(262144), _coplanarCacheSize(0), _coplanarCacheHits(0), _coplanarCacheMisses(0)
 {
 }
 
 BspTree::BspTree( const BspTree& copy, const osg::CopyOp& copyop ):
     osg::Object(copy,copyop),
     _preFaces(copy._preFaces), _root(copy._root),
-    _bound(copy._bound), _numSearchBestDivider(copy._numSearchBestDivider)
+    _bound(copy._bound), _numSearchBestDivider(copy._numSearchBestDivider),
+    _epsilon(copy._epsilon), _nodeStorage(copy._nodeStorage), _parallelBuild(copy._parallelBuild),
+    _parallelGrainSize(copy._parallelGrainSize), _taskPool(copy._taskPool), _arenaNodes(copy._arenaNodes),
+    _arenaFaceOffsets(copy._arenaFaceOffsets), _arenaPoints(copy._arenaPoints),
+    _coplanarCacheLimit(copy._coplanarCacheLimit), _coplanarCacheSize(0), _coplanarCacheHits(0), _coplanarCacheMisses(0)
 {
 }
 
 BspTree::~BspTree()
 {
+    clearCoplanarCache();
     destroyBspNode( _root );
 }
 
 void BspTree::buildBspTree()
 {
+    clearCoplanarCache();
     destroyBspNode( _root );
-    _root = createBspNode( _preFaces );
+    destroyArena();
+    _faceBoundTree = NULL;
+    if ( _nodeStorage==ARENA_NODES )
+    {
+        SubArena arena;
+        if ( _parallelBuild ) createArenaNodeParallel( _preFaces, getTaskPool(), arena );
+        else createArenaNode( _preFaces, arena );
+        _arenaNodes.swap( arena._nodes );
+        _arenaFaceOffsets.swap( arena._faceOffsets );
+        _arenaPoints.swap( arena._points );
+    }
+    else if ( _parallelBuild )
+        _root = createBspNodeParallel( _preFaces, getTaskPool() );
+    else
+        _root = createBspNode( _preFaces );
 
     for ( FaceList::iterator itr=_preFaces.begin(); itr!=_preFaces.end(); ++itr )
         _bound.expandBy( (*itr).getBound() );
 }
 
-BspTree::BspNode* BspTree::createBspNode( FaceList fl )
+BspTree::BspNode* BspTree::createBspNode( const FaceList& fl )
+{
+    FaceList posSubFaces, negSubFaces;
+    BspNode* node = createSplitNode( fl, posSubFaces, negSubFaces );
+    if ( !node ) return NULL;
+
+    node->_posChild = createBspNode( posSubFaces );
+    node->_negChild = createBspNode( negSubFaces );
+    return node;
+}
+
+struct BspTree::BuildNodeTask : public TaskPool::Task
+{
+    BspTree* _tree;
+    TaskPool* _pool;
+    FaceList _faces;
+    BspNode** _result;
+
+    BuildNodeTask( BspTree* tree, TaskPool* pool, FaceList& fl, BspNode** result ):
+        _tree(tree), _pool(pool), _result(result)
+    { _faces.swap( fl ); }
+
+    virtual void run()
+    { *_result = _tree->createBspNodeParallel( _faces, _pool ); }
+};
+
+BspTree::BspNode* BspTree::createBspNodeParallel( FaceList& fl, TaskPool* pool )
+{
+    if ( fl.size()<_parallelGrainSize ) return createBspNode( fl );
+
+    FaceList posSubFaces, negSubFaces;
+    BspNode* node = createSplitNode( fl, posSubFaces, negSubFaces );
+    if ( !node ) return NULL;
+
+    // Positive sub-tree may be stolen by other workers, while this thread goes on with the negative one.
+    TaskPool::TaskGroup group;
+    pool->spawn( new BuildNodeTask(this, pool, posSubFaces, &(node->_posChild)), &group );
+    node->_negChild = createBspNodeParallel( negSubFaces, pool );
+    pool->wait( &group );
+    return node;
+}
+
+BspTree::BspNode* BspTree::createSplitNode( const FaceList& fl, FaceList& posSubFaces, FaceList& negSubFaces )
 {
     if ( !fl.size() || !fl.front().valid() ) return NULL;
 
@@ -111,8 +369,8 @@ BspTree::BspNode* BspTree::createBspNode( FaceList fl )
     BspFace selFace = findBestDivider( fl, selPos );
     osg::Plane plane = calcPlane( selFace[0], selFace[1], selFace[2] );
     BspNode* node = new BspNode( plane );
-    FaceList posSubFaces, negSubFaces;
-    for ( FaceList::iterator itr=fl.begin(); itr!=fl.end(); ++itr, ++i )
+    BspFace posFace, negFace;  // Scratch faces reused for every split
+    for ( FaceList::const_iterator itr=fl.begin(); itr!=fl.end(); ++itr, ++i )
     {
         if ( i==selPos )
         {
@@ -120,8 +378,7 @@ BspTree::BspNode* BspTree::createBspNode( FaceList fl )
             continue;
         }
 
-        BspFace posFace, negFace, currFace=*itr;
-        FaceClassify type = partitionFace( node->_plane, currFace, posFace, negFace );
+        FaceClassify type = splitFace( node->_plane, *itr, posFace, negFace, _epsilon );
         switch ( type )
         {
         case CROSS_FACE:
@@ -129,21 +386,18 @@ BspTree::BspNode* BspTree::createBspNode( FaceList fl )
             negSubFaces.push_back( negFace );
             break;
         case POSITIVE_FACE:
-            posSubFaces.push_back( currFace );
+            posSubFaces.push_back( *itr );
             break;
         case NEGATIVE_FACE:
-            negSubFaces.push_back( currFace );
+            negSubFaces.push_back( *itr );
             break;
         case COINCIDENT_FACE:
-            node->_coinFaces.push_back( currFace );
+            node->_coinFaces.push_back( *itr );
             break;
         case INVALID_FACE:
 				break;
         }
     }
-
-    node->_posChild = createBspNode( posSubFaces );
-    node->_negChild = createBspNode( negSubFaces );
     return node;
 }
 
@@ -170,7 +424,7 @@ BspTree::BspNode* BspTree::createBspNode2D( FaceList fl )
             currFace.addPoint( face[(i+1)%size] );
             currFace.addPoint( face[i]+faceNormal );
 
-            FaceClassify type = partitionFace( node->_plane, currFace, posFace, negFace );
+            FaceClassify type = splitFace( node->_plane, currFace, posFace, negFace, _epsilon );
             switch ( type )
             {
             case CROSS_FACE:
@@ -197,12 +451,158 @@ BspTree::BspNode* BspTree::createBspNode2D( FaceList fl )
     return node;
 }
 
+unsigned int BspTree::createArenaSplitNode( const FaceList& fl, SubArena& arena,
+                                            FaceList& posSubFaces, FaceList& negSubFaces )
+{
+    if ( !fl.size() || !fl.front().valid() ) return INVALID_NODE;
+
+    unsigned int selPos, i=0;
+    BspFace selFace = findBestDivider( fl, selPos );
+    osg::Plane plane = calcPlane( selFace[0], selFace[1], selFace[2] );
+
+    // Nodes are stored in preorder, so the node itself must be allocated before its children.
+    unsigned int index = arena._nodes.size();
+    arena._nodes.push_back( BspArenaNode(plane) );
+    arena._nodes[index]._firstFace = arena._faceOffsets.size()-1;
+
+    unsigned int numFaces = 0;
+    BspFace posFace, negFace;
+    for ( FaceList::const_iterator itr=fl.begin(); itr!=fl.end(); ++itr, ++i )
+    {
+        if ( i==selPos )
+        {
+            arena._points.insert( arena._points.end(), itr->_points.begin(), itr->_points.end() );
+            arena._faceOffsets.push_back( arena._points.size() );
+            numFaces++;
+            continue;
+        }
+
+        FaceClassify type = splitFace( plane, *itr, posFace, negFace, _epsilon );
+        switch ( type )
+        {
+        case CROSS_FACE:
+            posSubFaces.push_back( posFace );
+            negSubFaces.push_back( negFace );
+            break;
+        case POSITIVE_FACE:
+            posSubFaces.push_back( *itr );
+            break;
+        case NEGATIVE_FACE:
+            negSubFaces.push_back( *itr );
+            break;
+        case COINCIDENT_FACE:
+            arena._points.insert( arena._points.end(), itr->_points.begin(), itr->_points.end() );
+            arena._faceOffsets.push_back( arena._points.size() );
+            numFaces++;
+            break;
+        case INVALID_FACE:
+            break;
+        }
+    }
+    arena._nodes[index]._numFaces = numFaces;
+    return index;
+}
+
+unsigned int BspTree::createArenaNode( const FaceList& fl, SubArena& arena )
+{
+    FaceList posSubFaces, negSubFaces;
+    unsigned int index = createArenaSplitNode( fl, arena, posSubFaces, negSubFaces );
+    if ( index==INVALID_NODE ) return INVALID_NODE;
+
+    // Don't keep references to the node here, as the arena may be reallocated while creating children.
+    unsigned int posChild = createArenaNode( posSubFaces, arena );
+    arena._nodes[index]._posChild = posChild;
+    unsigned int negChild = createArenaNode( negSubFaces, arena );
+    arena._nodes[index]._negChild = negChild;
+    return index;
+}
+
+struct BspTree::BuildArenaTask : public TaskPool::Task
+{
+    BspTree* _tree;
+    TaskPool* _pool;
+    FaceList _faces;
+    SubArena& _arena;
+
+    BuildArenaTask( BspTree* tree, TaskPool* pool, FaceList& fl, SubArena& arena ):
+        _tree(tree), _pool(pool), _arena(arena)
+    { _faces.swap( fl ); }
+
+    virtual void run()
+    { _tree->createArenaNodeParallel( _faces, _pool, _arena ); }
+};
+
+unsigned int BspTree::createArenaNodeParallel( FaceList& fl, TaskPool* pool, SubArena& arena )
+{
+    if ( fl.size()<_parallelGrainSize ) return createArenaNode( fl, arena );
+
+    FaceList posSubFaces, negSubFaces;
+    unsigned int index = createArenaSplitNode( fl, arena, posSubFaces, negSubFaces );
+    if ( index==INVALID_NODE ) return INVALID_NODE;
+
+    // Both sub-trees go to their own arenas and are appended in preorder, the same as a serial built one.
+    SubArena posArena, negArena;
+    TaskPool::TaskGroup group;
+    pool->spawn( new BuildArenaTask(this, pool, posSubFaces, posArena), &group );
+    createArenaNodeParallel( negSubFaces, pool, negArena );
+    pool->wait( &group );
+
+    unsigned int posChild = appendSubArena( arena, posArena );
+    arena._nodes[index]._posChild = posChild;
+    unsigned int negChild = appendSubArena( arena, negArena );
+    arena._nodes[index]._negChild = negChild;
+    return index;
+}
+
+unsigned int BspTree::appendSubArena( SubArena& arena, const SubArena& subArena )
+{
+    if ( !subArena._nodes.size() ) return INVALID_NODE;
+
+    unsigned int nodeBase = arena._nodes.size();
+    unsigned int faceBase = arena._faceOffsets.size()-1;
+    unsigned int pointBase = arena._points.size();
+    arena._nodes.reserve( nodeBase+subArena._nodes.size() );
+    for ( ArenaNodeList::const_iterator itr=subArena._nodes.begin(); itr!=subArena._nodes.end(); ++itr )
+    {
+        BspArenaNode node = *itr;
+        if ( node._posChild!=INVALID_NODE ) node._posChild += nodeBase;
+        if ( node._negChild!=INVALID_NODE ) node._negChild += nodeBase;
+        node._firstFace += faceBase;
+        arena._nodes.push_back( node );
+    }
+
+    for ( unsigned int i=1; i<subArena._faceOffsets.size(); ++i )
+        arena._faceOffsets.push_back( subArena._faceOffsets[i]+pointBase );
+    arena._points.insert( arena._points.end(), subArena._points.begin(), subArena._points.end() );
+    return nodeBase;
+}
+
+void BspTree::destroyArena()
+{
+    _arenaNodes.clear();
+    _arenaFaceOffsets.clear();
+    _arenaPoints.clear();
+}
+
+BspTree::BspFace BspTree::getArenaFace( unsigned int faceIndex ) const
+{
+    BspFace face;
+    if ( faceIndex+1>=_arenaFaceOffsets.size() ) return face;
+
+    face._points.insert( face._points.end(),
+        _arenaPoints.begin()+_arenaFaceOffsets[faceIndex],
+        _arenaPoints.begin()+_arenaFaceOffsets[faceIndex+1] );
+    return face;
+}
+
 void BspTree::destroyBspNode( BspNode*& node )
 {
     if ( !node ) return;
 
     destroyBspNode( node->_posChild );
     destroyBspNode( node->_negChild );
+    destroyBspNode( node->_coinTree2D );
+    destroyBspNode( node->_negCoinTree2D );
     delete node;
     node = 0;
 }
@@ -235,56 +635,252 @@ BspTree::FaceList BspTree::reverseFaces( FaceList fl )
     return negateFaces;
 }
 
-void BspTree::analyzeFace( BspNode* node, BspFace face, FaceList& posFaces, FaceList& negFaces,
-                          FaceList& coinSame, FaceList& coinNeg )
+BspTree* BspTree::createReversedTree()
 {
-    if ( !node || !face.valid() ) return;
+    BspTree* tree = new BspTree( _numSearchBestDivider );
+    tree->_epsilon = _epsilon;
+    tree->_preFaces = reverseFaces( _preFaces );
+    tree->_root = reverseBspNode( _root );
+    tree->_bound = _bound;
+    tree->_nodeStorage = _nodeStorage;
+
+    tree->_arenaNodes = _arenaNodes;
+    for ( ArenaNodeList::iterator itr=tree->_arenaNodes.begin(); itr!=tree->_arenaNodes.end(); ++itr )
+    {
+        itr->_plane.flip();
+        std::swap( itr->_posChild, itr->_negChild );
+    }
+
+    tree->_arenaFaceOffsets = _arenaFaceOffsets;
+    tree->_arenaPoints = _arenaPoints;
+    for ( unsigned int i=0; i+1<_arenaFaceOffsets.size(); ++i )
+    {
+        std::reverse( tree->_arenaPoints.begin()+_arenaFaceOffsets[i],
+            tree->_arenaPoints.begin()+_arenaFaceOffsets[i+1] );
+    }
+    return tree;
+}
+
+void BspTree::analyzeFace( BspFace face, FaceList& posFaces, FaceList& negFaces, FaceList& coinSame, FaceList& coinNeg,
+                          bool negated )
+{
+    if ( _nodeStorage==ARENA_NODES )
+    {
+        if ( _arenaNodes.size()>0 )
+            analyzeArenaFace( 0, face, posFaces, negFaces, coinSame, coinNeg, negated );
+    }
+    else
+        analyzeFace( _root, face, posFaces, negFaces, coinSame, coinNeg, negated );
+}
+
+void BspTree::clearCoplanarCache()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _coplanarCacheMutex );
+    for ( unsigned int i=0; i<_arenaCoinTrees.size(); ++i )
+        destroyBspNode( _arenaCoinTrees[i] );
+    destroyCoinTrees2D( _root );
+    _arenaCoinTrees.clear();
+
+    _coplanarCacheSize = 0;
+    _coplanarCacheHits = 0;
+    _coplanarCacheMisses = 0;
+}
+
+void BspTree::destroyCoinTrees2D( BspNode* node )
+{
+    if ( !node ) return;
+
+    destroyBspNode( node->_coinTree2D );
+    destroyBspNode( node->_negCoinTree2D );
+    destroyCoinTrees2D( node->_posChild );
+    destroyCoinTrees2D( node->_negChild );
+}
+
+unsigned int BspTree::countBspNodes( BspNode* node )
+{
+    if ( !node ) return 0;
+    return 1 + countBspNodes( node->_posChild ) + countBspNodes( node->_negChild );
+}
+
+BspTree::BspNode* BspTree::obtainCoinTree2D( BspNode* node, unsigned int arenaIndex, bool negated, bool& temporary )
+{
+    // Arena trees are stored in pairs, the second of which is built from reversed faces.
+    unsigned int arenaSlot = arenaIndex*2 + (negated ? 1 : 0);
+    temporary = false;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _coplanarCacheMutex );
+        if ( !node && _arenaCoinTrees.size()<_arenaNodes.size()*2 )
+            _arenaCoinTrees.resize( _arenaNodes.size()*2, NULL );
+
+        BspNode* cached = node ? (negated ? node->_negCoinTree2D : node->_coinTree2D) : _arenaCoinTrees[arenaSlot];
+        if ( cached )
+        {
+            _coplanarCacheHits++;
+            return cached;
+        }
+        _coplanarCacheMisses++;
+    }
+
+    // Build without locking, as building may wait for tasks which query the cache too.
+    FaceList coinFaces;
+    if ( node ) coinFaces = node->_coinFaces;
+    else
+    {
+        const BspArenaNode& arenaNode = _arenaNodes[arenaIndex];
+        for ( unsigned int i=0; i<arenaNode._numFaces; ++i )
+            coinFaces.push_back( getArenaFace(arenaNode._firstFace+i) );
+    }
+    if ( negated ) coinFaces = reverseFaces( coinFaces );
+    BspNode* root2D = createBspNode2D( coinFaces );
+    unsigned int numNodes = countBspNodes( root2D );
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _coplanarCacheMutex );
+    BspNode*& cached = node ? (negated ? node->_negCoinTree2D : node->_coinTree2D) : _arenaCoinTrees[arenaSlot];
+    if ( cached )
+    {
+        // Another thread has just cached the same tree.
+        destroyBspNode( root2D );
+        return cached;
+    }
+    else if ( _coplanarCacheSize+numNodes<=_coplanarCacheLimit )
+    {
+        _coplanarCacheSize += numNodes;
+        cached = root2D;
+    }
+    else
+        temporary = true;
+    return root2D;
+}
+
+void BspTree::clipCoincidentFace( const osg::Vec3& planeNormal, BspNode* root2D, BspFace& face,
+                                 FaceList& remains, FaceList& coinSame, FaceList& coinNeg )
+{
+    // Calculate the intersection and difference of current face & node-plane faces.
+    FaceList negList;
+    analyzeFace2D( root2D, face, remains, negList );
+
+    // Add intersection of faces, which have same directions with the current face, to result.
+    osg::Vec3 faceNormal = calcNormal( face[0], face[1], face[2] );
+    for ( FaceList::iterator itr=negList.begin(); itr!=negList.end(); ++itr )
+    {
+        if ( equivalent(planeNormal, faceNormal) ) coinSame.push_back( *itr );
+        else coinNeg.push_back( *itr );
+    }
+}
+
+/** Get classification of a face against the flipped plane. */
+static inline BspTree::FaceClassify negateClassify( BspTree::FaceClassify type )
+{
+    if ( type==BspTree::POSITIVE_FACE ) return BspTree::NEGATIVE_FACE;
+    else if ( type==BspTree::NEGATIVE_FACE ) return BspTree::POSITIVE_FACE;
+    return type;
+}
+
+void BspTree::analyzeArenaFace( unsigned int index, BspFace face, FaceList& posFaces, FaceList& negFaces,
+                               FaceList& coinSame, FaceList& coinNeg, bool negated )
+{
+    if ( index==INVALID_NODE || !face.valid() ) return;
 
+    // 'Front' is the positive side of the node, or the negative side if the tree is negated.
+    const BspArenaNode& node = _arenaNodes[index];
+    unsigned int frontChild = negated ? node._negChild : node._posChild;
+    unsigned int backChild = negated ? node._posChild : node._negChild;
     BspFace subPos, subNeg;
-    FaceClassify type = partitionFace( node->_plane, face, subPos, subNeg );
+    FaceClassify type = splitFace( node._plane, face, subPos, subNeg, _epsilon );
+    BspFace& frontPart = negated ? subNeg : subPos;
+    BspFace& backPart = negated ? subPos : subNeg;
+    if ( negated ) type = negateClassify( type );
     switch ( type )
     {
     case CROSS_FACE:
-        if ( node->_posChild ) analyzeFace( node->_posChild, subPos, posFaces, negFaces, coinSame, coinNeg );
-        else posFaces.push_back( subPos );
-        if ( node->_negChild ) analyzeFace( node->_negChild, subNeg, posFaces, negFaces, coinSame, coinNeg );
-        else negFaces.push_back( subNeg );
+        if ( frontChild!=INVALID_NODE ) analyzeArenaFace( frontChild, frontPart, posFaces, negFaces, coinSame, coinNeg, negated );
+        else posFaces.push_back( frontPart );
+        if ( backChild!=INVALID_NODE ) analyzeArenaFace( backChild, backPart, posFaces, negFaces, coinSame, coinNeg, negated );
+        else negFaces.push_back( backPart );
         break;
     case POSITIVE_FACE:
-        if ( node->_posChild ) analyzeFace( node->_posChild, face, posFaces, negFaces, coinSame, coinNeg );
+        if ( frontChild!=INVALID_NODE ) analyzeArenaFace( frontChild, face, posFaces, negFaces, coinSame, coinNeg, negated );
         else posFaces.push_back( face );
         break;
     case NEGATIVE_FACE:
-        if ( node->_negChild ) analyzeFace( node->_negChild, face, posFaces, negFaces, coinSame, coinNeg );
+        if ( backChild!=INVALID_NODE ) analyzeArenaFace( backChild, face, posFaces, negFaces, coinSame, coinNeg, negated );
         else negFaces.push_back( face );
         break;
     case COINCIDENT_FACE:
         {
-            // Calculate the intersection and difference of current face & node-plane faces.
-            FaceList posList, negList;
-            FaceList::iterator itr;
-            BspNode* root2D = createBspNode2D( node->_coinFaces );
-            analyzeFace2D( root2D, face, posList, negList );
-            destroyBspNode( root2D );
-
-            // Add intersection of faces, which have same directions with the current face, to result.
-            osg::Vec3 faceNormal = calcNormal( face[0], face[1], face[2] );
-            for ( itr=negList.begin(); itr!=negList.end(); ++itr )
+            FaceList posList;
+            bool temporary = false;
+            BspNode* root2D = obtainCoinTree2D( NULL, index, negated, temporary );
+            clipCoincidentFace( negated ? -node._plane.getNormal() : node._plane.getNormal(),
+                root2D, face, posList, coinSame, coinNeg );
+            if ( temporary ) destroyBspNode( root2D );
+
+            // Go on analyze difference faces.
+            for ( FaceList::iterator itr=posList.begin(); itr!=posList.end(); ++itr )
             {
-                osg::Vec3 n = calcNormal( (*itr)[0], (*itr)[1], (*itr)[2] );
-                if ( equivalent(node->_plane.getNormal(), faceNormal) ) coinSame.push_back( *itr );
-                else coinNeg.push_back( *itr );
+                if ( frontChild!=INVALID_NODE )
+                    analyzeArenaFace( frontChild, *itr, posFaces, negFaces, coinSame, coinNeg, negated );
+                else
+                    posFaces.push_back( *itr );
+                if ( backChild!=INVALID_NODE )
+                    analyzeArenaFace( backChild, *itr, posFaces, negFaces, coinSame, coinNeg, negated );
+                else
+                    negFaces.push_back( *itr );
             }
+        }
+        break;
+    case INVALID_FACE:
+        break;
+    }
+}
+
+void BspTree::analyzeFace( BspNode* node, BspFace face, FaceList& posFaces, FaceList& negFaces,
+                          FaceList& coinSame, FaceList& coinNeg, bool negated )
+{
+    if ( !node || !face.valid() ) return;
+
+    // 'Front' is the positive side of the node, or the negative side if the tree is negated.
+    BspNode* frontChild = negated ? node->_negChild : node->_posChild;
+    BspNode* backChild = negated ? node->_posChild : node->_negChild;
+    BspFace subPos, subNeg;
+    FaceClassify type = splitFace( node->_plane, face, subPos, subNeg, _epsilon );
+    BspFace& frontPart = negated ? subNeg : subPos;
+    BspFace& backPart = negated ? subPos : subNeg;
+    if ( negated ) type = negateClassify( type );
+    switch ( type )
+    {
+    case CROSS_FACE:
+        if ( frontChild ) analyzeFace( frontChild, frontPart, posFaces, negFaces, coinSame, coinNeg, negated );
+        else posFaces.push_back( frontPart );
+        if ( backChild ) analyzeFace( backChild, backPart, posFaces, negFaces, coinSame, coinNeg, negated );
+        else negFaces.push_back( backPart );
+        break;
+    case POSITIVE_FACE:
+        if ( frontChild ) analyzeFace( frontChild, face, posFaces, negFaces, coinSame, coinNeg, negated );
+        else posFaces.push_back( face );
+        break;
+    case NEGATIVE_FACE:
+        if ( backChild ) analyzeFace( backChild, face, posFaces, negFaces, coinSame, coinNeg, negated );
+        else negFaces.push_back( face );
+        break;
+    case COINCIDENT_FACE:
+        {
+            FaceList posList;
+            bool temporary = false;
+            BspNode* root2D = obtainCoinTree2D( node, INVALID_NODE, negated, temporary );
+            clipCoincidentFace( negated ? -node->_plane.getNormal() : node->_plane.getNormal(),
+                root2D, face, posList, coinSame, coinNeg );
+            if ( temporary ) destroyBspNode( root2D );
 
             // Go on analyze difference faces.
-            for ( itr=posList.begin(); itr!=posList.end(); ++itr )
+            for ( FaceList::iterator itr=posList.begin(); itr!=posList.end(); ++itr )
             {
-                if ( node->_posChild )
-                    analyzeFace( node->_posChild, *itr, posFaces, negFaces, coinSame, coinNeg );
+                if ( frontChild )
+                    analyzeFace( frontChild, *itr, posFaces, negFaces, coinSame, coinNeg, negated );
                 else
                     posFaces.push_back( *itr );
-                if ( node->_negChild )
-                    analyzeFace( node->_negChild, *itr, posFaces, negFaces, coinSame, coinNeg );
+                if ( backChild )
+                    analyzeFace( backChild, *itr, posFaces, negFaces, coinSame, coinNeg, negated );
                 else
                     negFaces.push_back( *itr );
             }
@@ -295,12 +891,63 @@ void BspTree::analyzeFace( BspNode* node, BspFace face, FaceList& posFaces, Face
     }
 }
 
+const BspTree::FaceBoundTree* BspTree::getFaceBoundTree()
+{
+    // Several operations may use the same tree at the same time, so only one of them builds it.
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _faceBoundMutex );
+    if ( !_faceBoundTree || _faceBoundTree->getPadding()!=_epsilon )
+        _faceBoundTree = new FaceBoundTree( _preFaces, _epsilon );
+    return _faceBoundTree.get();
+}
+
+BspTree::FaceClassify BspTree::classifyPoint( const osg::Vec3& point, bool negated )
+{
+    if ( _nodeStorage==ARENA_NODES )
+        return _arenaNodes.size()>0 ? classifyArenaPoint( 0, point, negated ) : INVALID_FACE;
+    return _root ? classifyPoint( _root, point, negated ) : INVALID_FACE;
+}
+
+BspTree::FaceClassify BspTree::classifyPoint( BspNode* node, const osg::Vec3& point, bool negated )
+{
+    BspNode* frontChild = negated ? node->_negChild : node->_posChild;
+    BspNode* backChild = negated ? node->_posChild : node->_negChild;
+    double distance = node->_plane.distance( point );
+    if ( negated ) distance = -distance;
+
+    // Reaching no child on the front side means outside, and on the back side means inside.
+    if ( distance>_epsilon ) return frontChild ? classifyPoint( frontChild, point, negated ) : POSITIVE_FACE;
+    if ( distance<-_epsilon ) return backChild ? classifyPoint( backChild, point, negated ) : NEGATIVE_FACE;
+
+    // Points on the plane are decided only if both sides agree.
+    FaceClassify front = frontChild ? classifyPoint( frontChild, point, negated ) : POSITIVE_FACE;
+    FaceClassify back = backChild ? classifyPoint( backChild, point, negated ) : NEGATIVE_FACE;
+    return front==back ? front : COINCIDENT_FACE;
+}
+
+BspTree::FaceClassify BspTree::classifyArenaPoint( unsigned int index, const osg::Vec3& point, bool negated )
+{
+    const BspArenaNode& node = _arenaNodes[index];
+    unsigned int frontChild = negated ? node._negChild : node._posChild;
+    unsigned int backChild = negated ? node._posChild : node._negChild;
+    double distance = node._plane.distance( point );
+    if ( negated ) distance = -distance;
+
+    if ( distance>_epsilon )
+        return frontChild!=INVALID_NODE ? classifyArenaPoint( frontChild, point, negated ) : POSITIVE_FACE;
+    if ( distance<-_epsilon )
+        return backChild!=INVALID_NODE ? classifyArenaPoint( backChild, point, negated ) : NEGATIVE_FACE;
+
+    FaceClassify front = frontChild!=INVALID_NODE ? classifyArenaPoint( frontChild, point, negated ) : POSITIVE_FACE;
+    FaceClassify back = backChild!=INVALID_NODE ? classifyArenaPoint( backChild, point, negated ) : NEGATIVE_FACE;
+    return front==back ? front : COINCIDENT_FACE;
+}
+
 void BspTree::analyzeFace2D( BspNode* node, BspFace face, FaceList& posFaces, FaceList& negFaces )
 {
     if ( !node ) return;
 
     BspFace subPos, subNeg;
-    FaceClassify type = partitionFace( node->_plane, face, subPos, subNeg );
+    FaceClassify type = splitFace( node->_plane, face, subPos, subNeg, _epsilon );
     switch ( type )
     {
     case CROSS_FACE:
@@ -376,54 +1023,147 @@ BspTree::FaceClassify BspTree::partitionFace( osg::Plane plane, BspFace face, Bs
     else return INVALID_FACE;
 }
 
-BspTree::BspFace BspTree::findBestDivider( FaceList fl, unsigned int& bestPos )
+/** Append a point to a split face. Only the previous point has to be checked for duplication, as split faces
+ * of convex polygons can only get equivalent points from intersections landing on an end of the edge.
+ * The previous point is replaced in that case, just like BspFace::addPoint() does.
+ */
+static inline void appendSplitPoint( BspTree::PointList& points, const osg::Vec3& p, double epsilon )
 {
-    BspFace* bestFace=&(fl.front());
-    double bestRelation=0.0f;
-    unsigned int leastCross=fl.size();
-    bestPos = 0;
+    if ( points.size()>0 && equivalent(points.back(), p, epsilon) ) points.back() = p;
+    else points.push_back( p );
+}
 
-    unsigned int i=0, checkNum;
-    if ( !_numSearchBestDivider || fl.size()<_numSearchBestDivider ) checkNum = 1;
-    else checkNum = fl.size()/_numSearchBestDivider;
+/** Remove the first point if the closing point added at last is equivalent to it. */
+static inline void closeSplitFace( BspTree::PointList& points, double epsilon )
+{
+    if ( points.size()>1 && equivalent(points.front(), points.back(), epsilon) )
+        points.erase( points.begin() );
+}
 
-    for ( FaceList::iterator fitr=fl.begin();
-        fitr!=fl.end() && (!_numSearchBestDivider || i<_numSearchBestDivider);
-        fitr=fitr+checkNum, ++i )
-    {
-        BspFace simpleFace = *fitr;
-        if ( !simpleFace.valid() ) continue;
+static inline int classifyDistance( double dis, double epsilon )
+{
+    if ( dis>epsilon ) return 1;
+    else if ( dis>=-epsilon ) return 0;
+    else return -1;
+}
 
-        osg::Plane plane = calcPlane( simpleFace[0], simpleFace[1], simpleFace[2] );
-        double relation=0.0f;
-        unsigned int posNum=0, negNum=0, crossNum=0;
+BspTree::FaceClassify BspTree::splitFace( const osg::Plane& plane, const BspFace& face, BspFace& posFace, BspFace& negFace,
+                                         double epsilon )
+{
+    posFace._points.clear();
+    negFace._points.clear();
 
-        for ( FaceList::iterator sitr=fl.begin(); sitr!=fl.end(); ++sitr )
-        {
-            if ( fitr==sitr ) continue;
+    unsigned int size = face._points.size();
+    if ( !size ) return INVALID_FACE;
 
-            BspFace posFace, negFace, currFace=*sitr;
-            FaceClassify type = partitionFace( plane, currFace, posFace, negFace );
-            switch ( type )
+    // Walk along edges, starting from the one ending at the second point, so that the first point is added at last.
+    const osg::Vec3& firstPt = face._points[0];
+    double firstDis = plane.distance( firstPt );
+    int firstState = classifyDistance( firstDis, epsilon );
+
+    const osg::Vec3* lastPt = &firstPt;
+    int lastState = firstState;
+    int posPt=0, negPt=0, coinPt=0;
+    for ( unsigned int i=1; i<=size; ++i )
+    {
+        const osg::Vec3& vec = (i==size) ? firstPt : face._points[i];
+        double dis = (i==size) ? firstDis : plane.distance( vec );
+        int state = (i==size) ? firstState : classifyDistance( dis, epsilon );
+
+        // The edge crosses the plane. Same as calcIntersect( vec, vec-lastPt, plane ), without copying the plane.
+        if ( state*lastState<0 )
+        {
+            osg::Vec3 v = vec - *lastPt;
+            double base = plane[0]*v.x() + plane[1]*v.y() + plane[2]*v.z();
+            osg::Vec3 ip = vec;
+            if ( base )
             {
-            case CROSS_FACE: crossNum++; break;
-            case POSITIVE_FACE: posNum++; break;
-            case NEGATIVE_FACE: negNum++; break;
-            default: break;
+                double t = -dis / base;
+                ip.set( vec.x()+t*v.x(), vec.y()+t*v.y(), vec.z()+t*v.z() );
             }
+            appendSplitPoint( posFace._points, ip, epsilon );
+            appendSplitPoint( negFace._points, ip, epsilon );
+        }
+
+        if ( state>0 )
+        {
+            posPt++;
+            appendSplitPoint( posFace._points, vec, epsilon );
+        }
+        else if ( state<0 )
+        {
+            negPt++;
+            appendSplitPoint( negFace._points, vec, epsilon );
+        }
+        else
+        {
+            coinPt++;
+            appendSplitPoint( posFace._points, vec, epsilon );
+            appendSplitPoint( negFace._points, vec, epsilon );
         }
 
-        // Record a better face.
-        if ( posNum>negNum ) relation = (double)negNum/(double)posNum;
-        else if ( negNum ) relation = (double)posNum/(double)negNum;
+        lastPt = &vec;
+        lastState = state;
+    }
+    closeSplitFace( posFace._points, epsilon );
+    closeSplitFace( negFace._points, epsilon );
 
-        if ( relation>bestRelation && crossNum<=leastCross )
+    if ( posPt>0 && negPt>0 ) return CROSS_FACE;
+    else if ( posPt>0 ) return POSITIVE_FACE;
+    else if ( negPt>0 ) return NEGATIVE_FACE;
+    else if ( coinPt>0 ) return COINCIDENT_FACE;
+    else return INVALID_FACE;
+}
+
+BspTree::BspFace BspTree::findBestDivider( const FaceList& fl, unsigned int& bestPos )
+{
+    bestPos = 0;
+
+    unsigned int checkNum, numFaces=fl.size();
+    if ( !_numSearchBestDivider || numFaces<_numSearchBestDivider ) checkNum = 1;
+    else checkNum = numFaces/_numSearchBestDivider;
+
+    PackedFaces packed( fl );
+    std::vector<unsigned int> candidates;
+    for ( unsigned int i=0, pos=0; pos<numFaces && (!_numSearchBestDivider || i<_numSearchBestDivider);
+        pos+=checkNum, ++i )
+    {
+        if ( fl[pos].valid() ) candidates.push_back( pos );
+    }
+
+    // Score all candidates, in parallel if the list is large enough.
+    unsigned int numCandidates = candidates.size();
+    std::vector<DividerScore> scores( numCandidates );
+    if ( _parallelBuild && numCandidates>1 && numFaces>=_parallelGrainSize )
+    {
+        TaskPool* pool = getTaskPool();
+        unsigned int numTasks = osg::minimum( numCandidates, pool->getNumThreads()+1 );
+        TaskPool::TaskGroup group;
+        for ( unsigned int t=0; t<numTasks; ++t )
+        {
+            pool->spawn( new ScoreDividerTask(fl, packed, candidates, scores,
+                numCandidates*t/numTasks, numCandidates*(t+1)/numTasks, _epsilon), &group );
+        }
+        pool->wait( &group );
+    }
+    else
+    {
+        std::vector<unsigned char> flags;
+        for ( unsigned int c=0; c<numCandidates; ++c )
+            scoreDivider( fl, packed, candidates[c], _epsilon, flags, scores[c] );
+    }
+
+    // Record the best face in order, so that the result is independent of scheduling.
+    double bestRelation=0.0f;
+    unsigned int leastCross=numFaces;
+    for ( unsigned int c=0; c<numCandidates; ++c )
+    {
+        if ( scores[c]._relation>bestRelation && scores[c]._crossNum<=leastCross )
         {
-            bestRelation = relation;
-            leastCross = crossNum;
-            bestFace = &(*fitr);
-            bestPos = fitr-fl.begin();
+            bestRelation = scores[c]._relation;
+            leastCross = scores[c]._crossNum;
+            bestPos = candidates[c];
         }
     }
-    return *bestFace;
+    return fl[bestPos];
 }
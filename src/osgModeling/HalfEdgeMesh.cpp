@@ -0,0 +1,221 @@
+/* -*-c++-*- osgModeling - Copyright (C) 2008 Wang Rui <wangray84@gmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <osgModeling/HalfEdgeMesh>
+
+using namespace osgModeling;
+
+HalfEdgeMesh::HalfEdgeMesh():
+    osg::Referenced(),
+    _numBorderHalfEdges(0), _numJunctionHalfEdges(0)
+{
+}
+
+HalfEdgeMesh::~HalfEdgeMesh()
+{
+}
+
+void HalfEdgeMesh::clear()
+{
+    _halfEdges.clear();
+    _faceOffsets.clear();
+    _vertexHalfEdges.clear();
+    _sourceIndices.clear();
+    _vertexMap.clear();
+    _outgoingOffsets.clear();
+    _outgoing.clear();
+    _halfEdgeEdges.clear();
+    _edgeHalfEdges.clear();
+    _welder.reset( 0.0 );
+    _numBorderHalfEdges = 0;
+    _numJunctionHalfEdges = 0;
+}
+
+bool HalfEdgeMesh::build( const osg::Vec3Array* vertices, const IndexList& faceSizes, const IndexList& faceIndices )
+{
+    clear();
+    if ( !vertices ) return false;
+
+    unsigned int numFaces = faceSizes.size();
+    unsigned int numHalfEdges = 0;
+    for ( unsigned int f=0; f<numFaces; ++f ) numHalfEdges += faceSizes[f];
+    if ( numHalfEdges!=faceIndices.size() ) return false;
+
+    // Merge source vertices at the same position into mesh vertices.
+    unsigned int numSources = vertices->size();
+    _welder.reset( 0.0, numSources );
+    _vertexMap.resize( numSources, INVALID_INDEX );
+    for ( unsigned int i=0; i<numHalfEdges; ++i )
+    {
+        unsigned int source = faceIndices[i];
+        if ( source>=numSources )
+        {
+            clear();
+            return false;
+        }
+
+        if ( _vertexMap[source]==INVALID_INDEX )
+        {
+            unsigned int v = _welder.weld( (*vertices)[source] );
+            if ( v==_sourceIndices.size() ) _sourceIndices.push_back( source );
+            _vertexMap[source] = v;
+        }
+    }
+
+    buildHalfEdges( faceSizes, faceIndices );
+    return true;
+}
+
+bool HalfEdgeMesh::build( unsigned int numVertices, const IndexList& faceSizes, const IndexList& faceIndices )
+{
+    clear();
+
+    unsigned int numFaces = faceSizes.size();
+    unsigned int numHalfEdges = 0;
+    for ( unsigned int f=0; f<numFaces; ++f ) numHalfEdges += faceSizes[f];
+    if ( numHalfEdges!=faceIndices.size() ) return false;
+
+    for ( unsigned int i=0; i<numHalfEdges; ++i )
+    {
+        if ( faceIndices[i]>=numVertices ) return false;
+    }
+
+    _sourceIndices.resize( numVertices );
+    for ( unsigned int v=0; v<numVertices; ++v ) _sourceIndices[v] = v;
+    _vertexMap = _sourceIndices;
+
+    buildHalfEdges( faceSizes, faceIndices );
+    return true;
+}
+
+void HalfEdgeMesh::buildHalfEdges( const IndexList& faceSizes, const IndexList& faceIndices )
+{
+    unsigned int numFaces = faceSizes.size(), numHalfEdges = faceIndices.size();
+
+    // Create half-edges of faces in order.
+    _halfEdges.resize( numHalfEdges );
+    _faceOffsets.resize( numFaces+1 );
+    for ( unsigned int f=0, h=0; f<numFaces; ++f )
+    {
+        _faceOffsets[f] = h;
+        for ( unsigned int i=0; i<faceSizes[f]; ++i, ++h )
+        {
+            HalfEdge& he = _halfEdges[h];
+            he._vertex = _vertexMap[faceIndices[h]];
+            he._face = f;
+            he._twin = INVALID_INDEX;
+        }
+    }
+    _faceOffsets[numFaces] = numHalfEdges;
+
+    // Bucket half-edges by their origins, so twins are searched among a few outgoing half-edges.
+    unsigned int numVertices = getNumVertices();
+    _outgoingOffsets.assign( numVertices+1, 0 );
+    for ( unsigned int h=0; h<numHalfEdges; ++h ) _outgoingOffsets[_halfEdges[h]._vertex+1]++;
+    for ( unsigned int v=0; v<numVertices; ++v ) _outgoingOffsets[v+1] += _outgoingOffsets[v];
+    _outgoing.resize( numHalfEdges );
+    IndexList fillPos( _outgoingOffsets.begin(), _outgoingOffsets.end()-1 );
+    for ( unsigned int h=0; h<numHalfEdges; ++h ) _outgoing[fillPos[_halfEdges[h]._vertex]++] = h;
+
+    // Pair each half-edge with the only one in the opposite direction. Edges used by more half-edges are junctions.
+    for ( unsigned int h=0; h<numHalfEdges; ++h )
+    {
+        if ( _halfEdges[h]._twin!=INVALID_INDEX ) continue;
+
+        unsigned int v0 = _halfEdges[h]._vertex, v1 = getTarget(h);
+        unsigned int twin = INVALID_INDEX, numOpposite = 0, numSame = 0;
+        for ( unsigned int i=_outgoingOffsets[v1]; i<_outgoingOffsets[v1+1]; ++i )
+        {
+            if ( getTarget(_outgoing[i])==v0 ) { twin = _outgoing[i]; ++numOpposite; }
+        }
+        for ( unsigned int i=_outgoingOffsets[v0]; i<_outgoingOffsets[v0+1]; ++i )
+        {
+            if ( _outgoing[i]!=h && getTarget(_outgoing[i])==v1 ) ++numSame;
+        }
+
+        if ( v0==v1 || numSame>0 || numOpposite>1 )
+            ++_numJunctionHalfEdges;
+        else if ( !numOpposite )
+            ++_numBorderHalfEdges;
+        else
+        {
+            _halfEdges[h]._twin = twin;
+            _halfEdges[twin]._twin = h;
+        }
+    }
+
+    // Record an outgoing half-edge for each vertex, preferring ones without twins.
+    // Edges are numbered in the order of their first half-edges.
+    _vertexHalfEdges.assign( numVertices, INVALID_INDEX );
+    _halfEdgeEdges.resize( numHalfEdges );
+    for ( unsigned int h=0; h<numHalfEdges; ++h )
+    {
+        unsigned int twin = _halfEdges[h]._twin;
+        unsigned int& vh = _vertexHalfEdges[_halfEdges[h]._vertex];
+        if ( vh==INVALID_INDEX || (twin==INVALID_INDEX && _halfEdges[vh]._twin!=INVALID_INDEX) )
+            vh = h;
+
+        if ( twin==INVALID_INDEX || h<twin )
+        {
+            _halfEdgeEdges[h] = _edgeHalfEdges.size();
+            _edgeHalfEdges.push_back( h );
+        }
+        else
+            _halfEdgeEdges[h] = _halfEdgeEdges[twin];
+    }
+}
+
+unsigned int HalfEdgeMesh::findHalfEdge( unsigned int v0, unsigned int v1 ) const
+{
+    if ( v0>=getNumVertices() ) return INVALID_INDEX;
+    for ( unsigned int i=_outgoingOffsets[v0]; i<_outgoingOffsets[v0+1]; ++i )
+    {
+        if ( getTarget(_outgoing[i])==v1 ) return _outgoing[i];
+    }
+    return INVALID_INDEX;
+}
+
+void HalfEdgeMesh::findNeighbors( unsigned int v, IndexList& vlist ) const
+{
+    if ( v>=getNumVertices() ) return;
+
+    unsigned int start = _vertexHalfEdges[v], h = start;
+    if ( h==INVALID_INDEX ) return;
+    do
+    {
+        vlist.push_back( getTarget(h) );
+
+        // Stop at a border, where the origin of the previous half-edge is the last neighbor.
+        unsigned int prev = getPrev( h );
+        h = _halfEdges[prev]._twin;
+        if ( h==INVALID_INDEX )
+        {
+            vlist.push_back( _halfEdges[prev]._vertex );
+            break;
+        }
+    } while ( h!=start );
+}
+
+void HalfEdgeMesh::findFaceNeighbors( unsigned int f, IndexList& flist ) const
+{
+    if ( f>=getNumFaces() ) return;
+    for ( unsigned int h=_faceOffsets[f]; h<_faceOffsets[f+1]; ++h )
+    {
+        unsigned int twin = _halfEdges[h]._twin;
+        if ( twin!=INVALID_INDEX ) flist.push_back( _halfEdges[twin]._face );
+    }
+}
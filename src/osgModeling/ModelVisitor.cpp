@@ -28,14 +28,11 @@ using namespace osgModeling;
 
 struct CalcTriangleFunctor
 {
-    typedef std::multiset<const osg::Vec3*, LessPtr> CoordinateSet;
     ModelVisitor::GeometryTask _task;
     unsigned int _coordSize;
-    CoordinateSet _coordSet;
     osg::Vec3Array* _coordArray;
 
     // Polymesh building variables & functions.
-    typedef std::pair<CoordinateSet::iterator, CoordinateSet::iterator> EqualGroup;
     PolyMesh::EdgeMap* _meshEdges;
     PolyMesh::FaceList* _meshFaces;
 
@@ -45,26 +42,20 @@ struct CalcTriangleFunctor
         _meshFaces = fl;
     }
 
-    inline void buildEdge( EqualGroup g1, EqualGroup g2, PolyMesh::Face* face )
+    inline void buildEdge( const osg::Vec3& p1, const osg::Vec3& p2, PolyMesh::Face* face )
     {
-        for ( CoordinateSet::iterator itr1=g1.first; itr1!=g1.second; ++itr1 )
+        // Edges are keyed by positions, so vertices at the same position share them.
+        PolyMesh::Segment p( p1, p2 );
+        if ( p2<p1 )
         {
-            osg::Vec3 p1 = *(*itr1);
-            for ( CoordinateSet::iterator itr2=g2.first; itr2!=g2.second; ++itr2 )
-            {
-                osg::Vec3 p2 = *(*itr2);
-                PolyMesh::Segment p( p1, p2 );
-                if ( p2<p1 )
-                {
-                    p.first = p2;
-                    p.second = p1;
-                }
-
-                if ( _meshEdges->find(p)==_meshEdges->end() )
-                    (*_meshEdges)[p] = new PolyMesh::Edge( p.first, p.second );
-                (*_meshEdges)[p]->hasFace( face, true );
-            }
+            p.first = p2;
+            p.second = p1;
         }
+
+        PolyMesh::EdgeMap::iterator itr = _meshEdges->find( p );
+        if ( itr==_meshEdges->end() )
+            itr = _meshEdges->insert( PolyMesh::EdgeMap::value_type(p, new PolyMesh::Edge(p.first, p.second)) ).first;
+        itr->second->hasFace( face, true );
     }
 
     inline void buildMesh( const osg::Vec3& v1, const osg::Vec3& v2, const osg::Vec3& v3 )
@@ -73,13 +64,11 @@ struct CalcTriangleFunctor
         int p1=&v1-cb, p2=&v2-cb, p3=&v3-cb;
         PolyMesh::Face* face =  new PolyMesh::Face( _coordArray, p1, p2, p3 );
         _meshFaces->push_back( face );
+        if ( !_meshEdges ) return;
 
-        EqualGroup g1=_coordSet.equal_range(&v1),
-            g2=_coordSet.equal_range(&v2),
-            g3=_coordSet.equal_range(&v3);
-        buildEdge( g1, g2, face );
-        buildEdge( g2, g3, face );
-        buildEdge( g3, g1, face ); 
+        buildEdge( v1, v2, face );
+        buildEdge( v2, v3, face );
+        buildEdge( v3, v1, face ); 
     }
 
     // BSP faces building variables & functions.
@@ -101,10 +90,6 @@ struct CalcTriangleFunctor
     {
         _coordSize = cs;
         _coordArray = ca;
-
-        osg::Vec3* vptr = &(ca->front());
-        for ( unsigned int i=0; i<cs; ++i )
-            _coordSet.insert( vptr++ );
     }
 
     inline void operator() ( const osg::Vec3& v1, const osg::Vec3& v2, const osg::Vec3& v3, bool treatVertexDataAsTemporary )
@@ -132,7 +117,8 @@ struct CalcTriangleFunctor
     }
 };
 
-ModelVisitor::ModelVisitor()
+ModelVisitor::ModelVisitor():
+    _nodeStorage(BspTree::ARENA_NODES)
 {
     setTraversalMode( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN );
 }
@@ -191,11 +177,15 @@ void ModelVisitor::buildMesh( PolyMesh& mesh )
     osg::Vec3Array* coords = dynamic_cast<osg::Vec3Array*>( mesh.getVertexArray() );
     if ( !coords || !coords->size() ) return;
 
+    // Half-edge meshes don't need the edge map, which is keyed by vertex positions.
+    bool halfEdges = mesh.getTopologyStorage()==PolyMesh::HALF_EDGE_TOPOLOGY;
     osg::TriangleFunctor<CalcTriangleFunctor> ctf;
     ctf.setTask( BUILD_MESH );
     ctf.setVerticsPtr( coords, coords->size() );
-    ctf.setMeshPtr( &(mesh._edges), &(mesh._faces) );
+    ctf.setMeshPtr( halfEdges ? NULL : &(mesh._edges), &(mesh._faces) );
     mesh.accept( ctf );
+    mesh.dirtyAdjacency();
+    if ( halfEdges ) mesh.buildHalfEdges();
 }
 
 void ModelVisitor::apply(osg::Geode& geode)
@@ -205,7 +195,15 @@ void ModelVisitor::apply(osg::Geode& geode)
         if ( _task==BUILD_BSP )
         {
             Model* model = dynamic_cast<Model*>( geode.getDrawable(i) );
-            if ( model ) buildBSP( *model );
+            if ( !model ) continue;
+
+            if ( !model->getBspTree() )
+            {
+                BspTree* bsp = new BspTree;
+                bsp->setNodeStorage( _nodeStorage );
+                model->setBspTree( bsp );
+            }
+            buildBSP( *model );
         }
         else if ( _task==BUILD_MESH )
         {
@@ -17,81 +17,103 @@
 
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <set>
 #include <osg/TriangleFunctor>
 #include <osgModeling/Utilities>
+#include <osgModeling/VertexWelder>
 #include <osgModeling/Model>
 #include <osgModeling/NormalVisitor>
 
 using namespace osgModeling;
 
-struct CalcNormalFunctor
+struct CollectTriangleFunctor
 {
-    typedef std::multiset<const osg::Vec3*, LessPtr> CoordinateSet;
     unsigned int _coordSize;
-    CoordinateSet _coordSet;
-    osg::Vec3* _coordBase;
+    const osg::Vec3* _coordBase;
+    const VertexGroupIndex* _coordGroups;
 
-    // Normal calculating variables & functions.
-    bool _flip;
-    int _method;
-    double _threshold;
-    osg::Vec3* _normalBase;
-    VECTOR<osg::Vec3> _lastNormalRecorder;
+    // Vertex groups of triangle corners, 3 for each triangle.
+    VECTOR<unsigned int> _corners;
+
+    // Vertices of triangle corners, only recorded when splitting vertices.
+    bool _recordVertices;
+    VECTOR<unsigned int> _cornerVertices;
+
+    CollectTriangleFunctor():
+        _coordSize(0), _coordBase(0), _coordGroups(0), _recordVertices(false)
+    {}
+
+    void setVerticsPtr( const osg::Vec3* cb, unsigned int cs, const VertexGroupIndex* groups )
+    {
+        _coordSize = cs;
+        _coordBase = cb;
+        _coordGroups = groups;
+        _corners.reserve( cs*6 );
+    }
 
-    void setNormalParameters( osg::Vec3* nb, bool flip, int method, double t )
+    inline unsigned int getGroup( const osg::Vec3& vec ) const
     {
-        _normalBase = nb;
-        _flip = flip;
-        _method = method;
-        _threshold = t;
+        // Vertices are usually in the array, so their groups are found without hashing.
+        unsigned int index = (unsigned int)(&vec - _coordBase);
+        if ( index<_coordSize ) return _coordGroups->getGroup( index );
+        return _coordGroups->findGroup( vec );
     }
 
-    inline void incNormal( const osg::Vec3& vec, const osg::Vec3& normal, double weight )
+    inline void operator() ( const osg::Vec3& v1, const osg::Vec3& v2, const osg::Vec3& v3, bool treatVertexDataAsTemporary )
     {
-        std::pair<CoordinateSet::iterator, CoordinateSet::iterator> p =
-            _coordSet.equal_range( &vec );
+        if ( treatVertexDataAsTemporary || v1==v2 || v1==v3 || v2==v3 )
+            return;
 
-        for ( CoordinateSet::iterator itr=p.first; itr!=p.second; ++itr )
+        if ( _recordVertices )
         {
-            int pos = *itr - _coordBase;
-            double t = normal * _lastNormalRecorder[pos];
-            if ( _threshold<1.0f )
-            {
-                if ( !equivalent(_lastNormalRecorder[pos], osg::Vec3(0.0f,0.0f,0.0f)) 
-                    && t<_threshold && t>-_threshold )
-                    continue;
-            }
+            // Only vertices of the array can be split.
+            unsigned int p1=&v1-_coordBase, p2=&v2-_coordBase, p3=&v3-_coordBase;
+            if ( p1>=_coordSize || p2>=_coordSize || p3>=_coordSize )
+                return;
 
-            osg::Vec3* nptr = _normalBase + pos;
-            *nptr += normal * weight;
-            _lastNormalRecorder[pos] = normal;
+            _cornerVertices.push_back( p1 );
+            _cornerVertices.push_back( p2 );
+            _cornerVertices.push_back( p3 );
         }
+
+        unsigned int g1=getGroup(v1), g2=getGroup(v2), g3=getGroup(v3);
+        if ( g1==VertexWelder::INVALID_INDEX || g2==VertexWelder::INVALID_INDEX || g3==VertexWelder::INVALID_INDEX )
+            return;
+
+        _corners.push_back( g1 );
+        _corners.push_back( g2 );
+        _corners.push_back( g3 );
     }
+};
 
-    // General functions.
-    CalcNormalFunctor():
-        _coordSize(0), _coordBase(0)
-    {}
+// Computes normal of each triangle and weights of its 3 corners.
+struct FaceNormalPass
+{
+    const osg::Vec3* _positions;
+    const VECTOR<unsigned int>& _corners;
+    bool _flip;
+    int _method;
+    VECTOR<osg::Vec3>& _faceNormals;
+    VECTOR<double>& _cornerWeights;
 
-    void setVerticsPtr( osg::Vec3* cb, unsigned int cs )
-    {
-        _coordSize = cs;
-        _coordBase = cb;
+    // Positions are indexed by vertex groups.
+    FaceNormalPass( const osg::Vec3* positions, const VECTOR<unsigned int>& corners, bool flip, int method,
+                    VECTOR<osg::Vec3>& normals, VECTOR<double>& weights ):
+        _positions(positions), _corners(corners), _flip(flip), _method(method), _faceNormals(normals), _cornerWeights(weights) {}
 
-        osg::Vec3* vptr = cb;
-        for ( unsigned int i=0; i<cs; ++i )
-        {
-            _coordSet.insert( vptr++ );
-            _lastNormalRecorder.push_back( osg::Vec3(0.0f,0.0f,0.0f) );
-        }
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        for ( unsigned int f=begin; f<end; ++f )
+            computeFace( f );
     }
 
-    inline void operator() ( const osg::Vec3& v1, const osg::Vec3& v2, const osg::Vec3& v3, bool treatVertexDataAsTemporary )
+    inline void computeFace( unsigned int f ) const
     {
-        if ( treatVertexDataAsTemporary || v1==v2 || v1==v3 || v2==v3 )
-            return;
-
-        double w[3]= { 1.0f, 1.0f, 1.0f };
+        const osg::Vec3& v1 = _positions[_corners[3*f]];
+        const osg::Vec3& v2 = _positions[_corners[3*f+1]];
+        const osg::Vec3& v3 = _positions[_corners[3*f+2]];
+        double* w = &(_cornerWeights[3*f]);
         switch ( _method )
         {
         case NormalVisitor::MWA:
@@ -120,13 +142,313 @@ struct CalcNormalFunctor
             w[2] = 1/sqrt((v1-v3).length()*(v2-v3).length());
             break;
         default:
+            w[0] = w[1] = w[2] = 1.0f;
             break;
         }
-        
-        osg::Vec3 normal = (v2-v1)^(v3-v1) * (_flip?-1.0f:1.0f);
-        incNormal( v1, normal, w[0] );
-        incNormal( v2, normal, w[1] );
-        incNormal( v3, normal, w[2] );
+
+        _faceNormals[f] = (v2-v1)^(v3-v1) * (_flip?-1.0f:1.0f);
+    }
+};
+
+// Indexes corners by vertex groups. Corners of each group are placed in the order of triangles.
+static void indexCornersByGroup( const VECTOR<unsigned int>& corners, unsigned int numGroups,
+                                 VECTOR<unsigned int>& cornerOffsets, VECTOR<unsigned int>& groupCorners )
+{
+    cornerOffsets.assign( numGroups+1, 0 );
+    for ( unsigned int i=0; i<corners.size(); ++i )
+        ++cornerOffsets[corners[i]+1];
+    for ( unsigned int g=0; g<numGroups; ++g )
+        cornerOffsets[g+1] += cornerOffsets[g];
+
+    VECTOR<unsigned int> fill( cornerOffsets.begin(), cornerOffsets.end()-1 );
+    groupCorners.resize( corners.size() );
+    for ( unsigned int i=0; i<corners.size(); ++i )
+        groupCorners[fill[corners[i]]++] = i;
+}
+
+// Adds a face normal to a vertex group. It is skipped if the angle to the last added normal is near 90 degrees.
+static inline void addNormal( osg::Vec3& sum, osg::Vec3& lastNormal, const osg::Vec3& normal, double weight, double threshold )
+{
+    double t = normal * lastNormal;
+    if ( threshold<1.0f )
+    {
+        if ( !equivalent(lastNormal, osg::Vec3(0.0f,0.0f,0.0f))
+            && t<threshold && t>-threshold )
+            return;
+    }
+
+    sum += normal * weight;
+    lastNormal = normal;
+}
+
+// Sums face normals around each vertex group and writes the result to all vertices of the group.
+// Corners of a group are visited in the order of triangles, so the threshold test sees the same
+// last normal as when adding triangles one by one.
+struct GatherNormalPass
+{
+    const VertexGroupIndex& _groups;
+    const VECTOR<unsigned int>& _cornerOffsets;
+    const VECTOR<unsigned int>& _groupCorners;
+    const VECTOR<osg::Vec3>& _faceNormals;
+    const VECTOR<double>& _cornerWeights;
+    double _threshold;
+    osg::Vec3Array& _normals;
+
+    GatherNormalPass( const VertexGroupIndex& groups, const VECTOR<unsigned int>& offsets, const VECTOR<unsigned int>& corners,
+                      const VECTOR<osg::Vec3>& faceNormals, const VECTOR<double>& weights, double threshold, osg::Vec3Array& normals ):
+        _groups(groups), _cornerOffsets(offsets), _groupCorners(corners), _faceNormals(faceNormals),
+        _cornerWeights(weights), _threshold(threshold), _normals(normals) {}
+
+    static inline void setGroupNormal( const VertexGroupIndex& groups, osg::Vec3 sum, unsigned int g, osg::Vec3Array& normals )
+    {
+        sum.normalize();
+        const unsigned int* groupEnd = groups.groupEnd( g );
+        for ( const unsigned int* itr=groups.groupBegin(g); itr!=groupEnd; ++itr )
+            normals[*itr] = sum;
+    }
+
+    static void setGroupNormals( const VertexGroupIndex& groups, const VECTOR<osg::Vec3>& sums,
+                                 unsigned int begin, unsigned int end, osg::Vec3Array& normals )
+    {
+        for ( unsigned int g=begin; g<end; ++g )
+            setGroupNormal( groups, sums[g], g, normals );
+    }
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        for ( unsigned int g=begin; g<end; ++g )
+            gatherGroup( g );
+    }
+
+    inline void gatherGroup( unsigned int g ) const
+    {
+        osg::Vec3 sum(0.0f, 0.0f, 0.0f), lastNormal(0.0f, 0.0f, 0.0f);
+        for ( unsigned int i=_cornerOffsets[g]; i<_cornerOffsets[g+1]; ++i )
+        {
+            unsigned int corner = _groupCorners[i];
+            addNormal( sum, lastNormal, _faceNormals[corner/3], _cornerWeights[corner], _threshold );
+        }
+        setGroupNormal( _groups, sum, g, _normals );
+    }
+};
+
+// Clusters corners around vertex groups by crease angle, and splits vertices used by more than one cluster.
+// Two corners are in the same cluster if their triangles share an edge at the group and normals of the
+// triangles differ less than the crease angle, or they are connected by such corners.
+struct CreaseSplitter
+{
+    const VECTOR<unsigned int>& _corners;
+    const VECTOR<unsigned int>& _cornerVertices;
+    const VECTOR<osg::Vec3>& _faceNormals;
+    const VECTOR<double>& _cornerWeights;
+    double _cosCrease;
+
+    VECTOR<unsigned int> _newIndices;  // New vertex of each corner
+    VECTOR<unsigned int> _splitSources;  // Source vertex of each added vertex
+    VECTOR<osg::Vec3> _splitNormals;  // Normals of added vertices
+
+    CreaseSplitter( const VECTOR<unsigned int>& corners, const VECTOR<unsigned int>& vertices,
+                    const VECTOR<osg::Vec3>& faceNormals, const VECTOR<double>& weights, double creaseAngle ):
+        _corners(corners), _cornerVertices(vertices), _faceNormals(faceNormals), _cornerWeights(weights),
+        _cosCrease(cos(creaseAngle))
+    {}
+
+    inline unsigned int findRoot( unsigned int i )
+    {
+        while ( _parents[i]!=i )
+        {
+            _parents[i] = _parents[_parents[i]];
+            i = _parents[i];
+        }
+        return _parents[i];
+    }
+
+    void splitGroup( const unsigned int* begin, const unsigned int* end, osg::Vec3Array& normals )
+    {
+        unsigned int size = end - begin;
+        _parents.resize( size );
+        _edgeEnds.clear();
+        for ( unsigned int i=0; i<size; ++i )
+        {
+            unsigned int corner=begin[i], base=corner-corner%3;
+            _parents[i] = i;
+            _edgeEnds.push_back( std::pair<unsigned int, unsigned int>(_corners[base+(corner+1)%3], i) );
+            _edgeEnds.push_back( std::pair<unsigned int, unsigned int>(_corners[base+(corner+2)%3], i) );
+        }
+
+        // Corners with the same other end share an edge.
+        std::sort( _edgeEnds.begin(), _edgeEnds.end() );
+        for ( unsigned int i=1; i<_edgeEnds.size(); ++i )
+        {
+            if ( _edgeEnds[i].first!=_edgeEnds[i-1].first ) continue;
+
+            unsigned int c1=_edgeEnds[i-1].second, c2=_edgeEnds[i].second;
+            const osg::Vec3& n1 = _faceNormals[begin[c1]/3];
+            const osg::Vec3& n2 = _faceNormals[begin[c2]/3];
+            if ( n1*n2 >= _cosCrease*n1.length()*n2.length() )
+                _parents[findRoot(c1)] = findRoot( c2 );
+        }
+
+        // Sum normals of each cluster, in the order of triangles.
+        _clusterNormals.assign( size, osg::Vec3(0.0f, 0.0f, 0.0f) );
+        for ( unsigned int i=0; i<size; ++i )
+        {
+            unsigned int corner = begin[i];
+            _clusterNormals[findRoot(i)] += _faceNormals[corner/3] * _cornerWeights[corner];
+        }
+        for ( unsigned int i=0; i<size; ++i )
+        {
+            if ( _parents[i]==i ) _clusterNormals[i].normalize();
+        }
+
+        // The first cluster using a vertex keeps it, and others use copies of the vertex.
+        _vertexClusters.clear();
+        for ( unsigned int i=0; i<size; ++i )
+        {
+            unsigned int corner=begin[i], vertex=_cornerVertices[corner], root=findRoot(i);
+            unsigned int newIndex = VertexWelder::INVALID_INDEX;
+            bool vertexUsed = false;
+            for ( unsigned int j=0; j<_vertexClusters.size(); ++j )
+            {
+                VertexCluster& vc = _vertexClusters[j];
+                if ( vc._vertex!=vertex ) continue;
+                vertexUsed = true;
+                if ( vc._cluster==root )
+                {
+                    newIndex = vc._newIndex;
+                    break;
+                }
+            }
+
+            if ( newIndex==VertexWelder::INVALID_INDEX )
+            {
+                if ( !vertexUsed )
+                {
+                    newIndex = vertex;
+                    normals[vertex] = _clusterNormals[root];
+                }
+                else
+                {
+                    newIndex = normals.size() + _splitSources.size();
+                    _splitSources.push_back( vertex );
+                    _splitNormals.push_back( _clusterNormals[root] );
+                }
+                _vertexClusters.push_back( VertexCluster(vertex, root, newIndex) );
+            }
+            _newIndices[corner] = newIndex;
+        }
+    }
+
+    void operator()( const VECTOR<unsigned int>& cornerOffsets, const VECTOR<unsigned int>& groupCorners, osg::Vec3Array& normals )
+    {
+        _newIndices.resize( _corners.size() );
+        unsigned int numGroups = cornerOffsets.size()-1;
+        for ( unsigned int g=0; g<numGroups; ++g )
+        {
+            if ( cornerOffsets[g]==cornerOffsets[g+1] ) continue;
+            splitGroup( &(groupCorners.front())+cornerOffsets[g], &(groupCorners.front())+cornerOffsets[g+1], normals );
+        }
+    }
+
+protected:
+    struct VertexCluster
+    {
+        unsigned int _vertex, _cluster, _newIndex;
+        VertexCluster( unsigned int v, unsigned int c, unsigned int n ): _vertex(v), _cluster(c), _newIndex(n) {}
+    };
+
+    // Scratch data of current group.
+    VECTOR<unsigned int> _parents;
+    VECTOR< std::pair<unsigned int, unsigned int> > _edgeEnds;
+    VECTOR<osg::Vec3> _clusterNormals;
+    VECTOR<VertexCluster> _vertexClusters;
+};
+
+// Appends copies of source vertices to a per-vertex array.
+class AppendVerticesVisitor : public osg::ArrayVisitor
+{
+public:
+    AppendVerticesVisitor( const VECTOR<unsigned int>& sources ): _sources(sources) {}
+
+    template<class ArrayType>
+    void appendVertices( ArrayType& array )
+    {
+        array.reserve( array.size()+_sources.size() );
+        for ( unsigned int i=0; i<_sources.size(); ++i )
+            array.push_back( array[_sources[i]] );
+        array.dirty();
+    }
+
+    virtual void apply( osg::ByteArray& array ) { appendVertices( array ); }
+    virtual void apply( osg::ShortArray& array ) { appendVertices( array ); }
+    virtual void apply( osg::IntArray& array ) { appendVertices( array ); }
+    virtual void apply( osg::UByteArray& array ) { appendVertices( array ); }
+    virtual void apply( osg::UShortArray& array ) { appendVertices( array ); }
+    virtual void apply( osg::UIntArray& array ) { appendVertices( array ); }
+    virtual void apply( osg::FloatArray& array ) { appendVertices( array ); }
+    virtual void apply( osg::Vec2Array& array ) { appendVertices( array ); }
+    virtual void apply( osg::Vec3Array& array ) { appendVertices( array ); }
+    virtual void apply( osg::Vec4Array& array ) { appendVertices( array ); }
+    virtual void apply( osg::Vec4ubArray& array ) { appendVertices( array ); }
+
+protected:
+    const VECTOR<unsigned int>& _sources;
+};
+
+static void appendVertices( osg::Array* array, osg::Geometry::AttributeBinding binding,
+                            unsigned int numVertices, AppendVerticesVisitor& visitor )
+{
+    if ( array && binding==osg::Geometry::BIND_PER_VERTEX && array->getNumElements()==numVertices )
+        array->accept( visitor );
+}
+
+/** Collect arrays which are changed when vertices of a geometry are split at creases. */
+static void collectCreaseArrays( osg::Geometry& geom, VECTOR<osg::Array*>& arrays )
+{
+    arrays.push_back( geom.getVertexArray() );
+    arrays.push_back( geom.getNormalArray() );
+    arrays.push_back( geom.getColorArray() );
+    arrays.push_back( geom.getSecondaryColorArray() );
+    arrays.push_back( geom.getFogCoordArray() );
+    for ( unsigned int i=0; i<geom.getNumTexCoordArrays(); ++i )
+        arrays.push_back( geom.getTexCoordArray(i) );
+    for ( unsigned int i=0; i<geom.getNumVertexAttribArrays(); ++i )
+        arrays.push_back( geom.getVertexAttribArray(i) );
+}
+
+static unsigned int findBatchRoot( VECTOR<unsigned int>& parents, unsigned int i )
+{
+    while ( parents[i]!=i )
+    {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+struct BuildNormalTask : public TaskPool::Task
+{
+    VECTOR<osg::Geometry*> _geometries;
+    bool _flip;
+    int _method;
+    double _threshold;
+    double _creaseAngle;
+    TaskPool* _pool;
+    unsigned int _grainSize;
+
+    BuildNormalTask( const VECTOR<osg::Geometry*>& geometries, bool flip, int method, double threshold, double creaseAngle,
+                     TaskPool* pool, unsigned int grainSize ):
+        _geometries(geometries), _flip(flip), _method(method), _threshold(threshold), _creaseAngle(creaseAngle),
+        _pool(pool), _grainSize(grainSize) {}
+
+    virtual void run()
+    {
+        for ( unsigned int i=0; i<_geometries.size(); ++i )
+        {
+            osg::Geometry& geom = *_geometries[i];
+            if ( _creaseAngle>0.0 ) NormalVisitor::buildCreaseNormal( geom, _creaseAngle, _flip, _method );
+            else NormalVisitor::buildNormal( geom, _flip, _method, _threshold, _pool, _grainSize );
+        }
     }
 };
 
@@ -135,6 +457,9 @@ NormalVisitor::NormalVisitor( int method, bool flip )
     _threshold = 1e-6f;
     _method = method;
     _flip = flip;
+    _creaseAngle = 0.0;
+    _parallel = false;
+    _parallelGrainSize = 4096;
     setTraversalMode( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN );
 }
 
@@ -168,41 +493,330 @@ bool NormalVisitor::checkPrimitives( osg::Geometry& geom )
     return true;
 }
 
-void NormalVisitor::buildNormal( osg::Geometry& geom, bool flip, int method, double threshold )
+void NormalVisitor::buildNormal( osg::Geometry& geom, bool flip, int method, double threshold,
+                                 TaskPool* pool, unsigned int grainSize )
 {
     if ( !checkPrimitives(geom) ) return;
 
     osg::Vec3Array *coords = dynamic_cast<osg::Vec3Array*>( geom.getVertexArray() );
     if ( !coords || !coords->size() ) return;
 
-    osg::Vec3Array::iterator nitr;
+    VertexGroupIndex groups;
+    groups.build( coords );
+
+    osg::TriangleFunctor<CollectTriangleFunctor> ctf;
+    ctf.setVerticsPtr( &(coords->front()), coords->size(), &groups );
+    geom.accept( ctf );
+
+    unsigned int numTriangles = ctf._corners.size()/3;
+    VECTOR<osg::Vec3> faceNormals( numTriangles );
+    VECTOR<double> cornerWeights( ctf._corners.size() );
+    TaskPool::parallelFor( FaceNormalPass(&(groups.getGroupPositions()->front()), ctf._corners, flip, method, faceNormals, cornerWeights),
+        numTriangles, pool, grainSize );
+
+    unsigned int numGroups = groups.getNumGroups();
     osg::Vec3Array *normals = new osg::Vec3Array( coords->size() );
-    for ( nitr=normals->begin(); nitr!=normals->end(); ++nitr )
+    if ( !pool || !grainSize || numGroups<=grainSize )
+    {
+        // Add triangles one by one to their vertex groups.
+        VECTOR<osg::Vec3> sums( numGroups ), lastNormals( numGroups );
+        for ( unsigned int i=0; i<ctf._corners.size(); ++i )
+        {
+            unsigned int g = ctf._corners[i];
+            const osg::Vec3& normal = faceNormals[i/3];
+            addNormal( sums[g], lastNormals[g], normal, cornerWeights[i], threshold );
+        }
+        GatherNormalPass::setGroupNormals( groups, sums, 0, numGroups, *normals );
+    }
+    else
+    {
+        // Index corners by vertex groups, so each group is summed by only one task.
+        VECTOR<unsigned int> cornerOffsets, groupCorners;
+        indexCornersByGroup( ctf._corners, numGroups, cornerOffsets, groupCorners );
+
+        TaskPool::parallelFor( GatherNormalPass(groups, cornerOffsets, groupCorners, faceNormals, cornerWeights, threshold, *normals),
+            numGroups, pool, grainSize );
+    }
+
+    geom.setNormalArray( normals );
+    geom.setNormalIndices( geom.getVertexIndices() );
+    geom.setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+}
+
+unsigned int NormalVisitor::buildCreaseNormal( osg::Geometry& geom, double creaseAngle, bool flip, int method )
+{
+    if ( !checkPrimitives(geom) ) return 0;
+
+    osg::Vec3Array *coords = dynamic_cast<osg::Vec3Array*>( geom.getVertexArray() );
+    if ( !coords || !coords->size() ) return 0;
+
+    if ( geom.getVertexIndices() )
     {
-        nitr->set( 0.0f, 0.0f, 0.0f );
+        osg::notify(osg::WARN) << "osgModeling: Vertices with indices can't be split at creases." << std::endl;
+        buildNormal( geom, flip, method );
+        return 0;
     }
 
-    osg::TriangleFunctor<CalcNormalFunctor> ctf;
-    ctf.setVerticsPtr( &(coords->front()), coords->size() );
-    ctf.setNormalParameters( &(normals->front()), flip, method, threshold );
+    VertexGroupIndex groups;
+    groups.build( coords );
+
+    osg::TriangleFunctor<CollectTriangleFunctor> ctf;
+    ctf.setVerticsPtr( &(coords->front()), coords->size(), &groups );
+    ctf._recordVertices = true;
+    ctf._cornerVertices.reserve( ctf._corners.capacity() );
     geom.accept( ctf );
 
-    for ( nitr=normals->begin(); nitr!=normals->end(); ++nitr )
+    unsigned int numTriangles = ctf._corners.size()/3;
+    VECTOR<osg::Vec3> faceNormals( numTriangles );
+    VECTOR<double> cornerWeights( ctf._corners.size() );
+    FaceNormalPass( &(groups.getGroupPositions()->front()), ctf._corners, flip, method, faceNormals, cornerWeights )( 0, numTriangles );
+
+    VECTOR<unsigned int> cornerOffsets, groupCorners;
+    indexCornersByGroup( ctf._corners, groups.getNumGroups(), cornerOffsets, groupCorners );
+
+    unsigned int numVertices = coords->size();
+    osg::Vec3Array *normals = new osg::Vec3Array( numVertices );
+    CreaseSplitter splitter( ctf._corners, ctf._cornerVertices, faceNormals, cornerWeights, creaseAngle );
+    splitter( cornerOffsets, groupCorners, *normals );
+
+    // Copy all per-vertex attributes to added vertices.
+    unsigned int numSplits = splitter._splitSources.size();
+    if ( numSplits )
     {
-        nitr->normalize();
+        AppendVerticesVisitor appender( splitter._splitSources );
+        coords->accept( appender );
+        appendVertices( geom.getColorArray(), geom.getColorBinding(), numVertices, appender );
+        appendVertices( geom.getSecondaryColorArray(), geom.getSecondaryColorBinding(), numVertices, appender );
+        appendVertices( geom.getFogCoordArray(), geom.getFogCoordBinding(), numVertices, appender );
+        for ( unsigned int i=0; i<geom.getNumTexCoordArrays(); ++i )
+            appendVertices( geom.getTexCoordArray(i), osg::Geometry::BIND_PER_VERTEX, numVertices, appender );
+        for ( unsigned int i=0; i<geom.getNumVertexAttribArrays(); ++i )
+            appendVertices( geom.getVertexAttribArray(i), geom.getVertexAttribBinding(i), numVertices, appender );
+        normals->insert( normals->end(), splitter._splitNormals.begin(), splitter._splitNormals.end() );
     }
 
+    // Replace surface primitives with the triangles using new vertices. Points and lines still use old vertices.
+    osg::Geometry::PrimitiveSetList& primitives = geom.getPrimitiveSetList();
+    for ( int i=primitives.size()-1; i>=0; --i )
+    {
+        switch ( primitives[i]->getMode() )
+        {
+        case (osg::PrimitiveSet::TRIANGLES):
+        case (osg::PrimitiveSet::TRIANGLE_STRIP):
+        case (osg::PrimitiveSet::TRIANGLE_FAN):
+        case (osg::PrimitiveSet::QUADS):
+        case (osg::PrimitiveSet::QUAD_STRIP):
+        case (osg::PrimitiveSet::POLYGON):
+            geom.removePrimitiveSet( i );
+            break;
+        default:
+            break;
+        }
+    }
+    geom.addPrimitiveSet( new osg::DrawElementsUInt(osg::PrimitiveSet::TRIANGLES,
+        splitter._newIndices.begin(), splitter._newIndices.end()) );
+
     geom.setNormalArray( normals );
-    geom.setNormalIndices( geom.getVertexIndices() );
+    geom.setNormalIndices( NULL );
     geom.setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    geom.dirtyDisplayList();
+    geom.dirtyBound();
+    return numSplits;
 }
 
 void NormalVisitor::apply(osg::Geode& geode)
 {
+    TaskPool* pool = _parallel ? getTaskPool() : NULL;
+    if ( !pool || geode.getNumDrawables()<2 )
+    {
+        for(unsigned int i = 0; i < geode.getNumDrawables(); i++ )
+        {
+          osg::Geometry* geom = dynamic_cast<osg::Geometry*>( geode.getDrawable(i) );
+          if ( !geom ) continue;
+          if ( _creaseAngle>0.0 ) buildCreaseNormal( *geom, _creaseAngle, _flip, _method );
+          else buildNormal( *geom, _flip, _method, _threshold, pool, _parallelGrainSize );
+        }
+        return;
+    }
+
+    // A drawable may be added more than once, but must be built by only one task.
+    VECTOR<osg::Geometry*> geometries;
+    std::set<osg::Geometry*> added;
     for(unsigned int i = 0; i < geode.getNumDrawables(); i++ )
     {
-      osg::Geometry* geom = dynamic_cast<osg::Geometry*>( geode.getDrawable(i) );
-      if ( geom ) buildNormal( *geom, _flip, _method, _threshold );
+        osg::Geometry* geom = dynamic_cast<osg::Geometry*>( geode.getDrawable(i) );
+        if ( geom && added.insert(geom).second ) geometries.push_back( geom );
     }
+
+    // Splitting vertices at creases appends to vertex and attribute arrays, so geometries sharing any of them
+    // are built one after another by the same task, in the order of drawables.
+    unsigned int numGeometries = geometries.size();
+    VECTOR<unsigned int> parents( numGeometries );
+    for ( unsigned int i=0; i<numGeometries; ++i ) parents[i] = i;
+    if ( _creaseAngle>0.0 )
+    {
+        std::map<osg::Array*, unsigned int> arrayOwners;
+        VECTOR<osg::Array*> arrays;
+        for ( unsigned int i=0; i<numGeometries; ++i )
+        {
+            arrays.clear();
+            collectCreaseArrays( *geometries[i], arrays );
+            for ( unsigned int j=0; j<arrays.size(); ++j )
+            {
+                if ( !arrays[j] ) continue;
+                std::map<osg::Array*, unsigned int>::iterator itr = arrayOwners.find( arrays[j] );
+                if ( itr==arrayOwners.end() ) arrayOwners[arrays[j]] = i;
+                else parents[findBatchRoot(parents, i)] = findBatchRoot( parents, itr->second );
+            }
+        }
+    }
+
+    VECTOR< VECTOR<osg::Geometry*> > batches;
+    VECTOR<unsigned int> batchIndices( numGeometries, numGeometries );
+    for ( unsigned int i=0; i<numGeometries; ++i )
+    {
+        unsigned int& index = batchIndices[findBatchRoot(parents, i)];
+        if ( index==numGeometries )
+        {
+            index = batches.size();
+            batches.push_back( VECTOR<osg::Geometry*>() );
+        }
+        batches[index].push_back( geometries[i] );
+    }
+
+    TaskPool::TaskGroup group;
+    for ( unsigned int i=0; i<batches.size(); ++i )
+        pool->spawn( new BuildNormalTask(batches[i], _flip, _method, _threshold, _creaseAngle,
+                                         pool, _parallelGrainSize), &group );
+    pool->wait( &group );
+}
+
+
+NormalUpdater::NormalUpdater( int method, bool flip, double threshold ):
+    _method(method), _flip(flip), _threshold(threshold), _currentMark(0)
+{
 }
 
+NormalUpdater::~NormalUpdater()
+{
+}
+
+void NormalUpdater::clear()
+{
+    _vertices = NULL;
+    _groups.build( NULL, 0 );
+    _corners.clear();
+    _cornerOffsets.clear();
+    _groupCorners.clear();
+    _groupPositions.clear();
+    _faceNormals.clear();
+    _cornerWeights.clear();
+    _faceMarks.clear();
+    _groupMarks.clear();
+    _currentMark = 0;
+}
+
+osg::Vec3Array* NormalUpdater::getNormalArray( osg::Geometry& geom, unsigned int numVertices )
+{
+    osg::Vec3Array* normals = dynamic_cast<osg::Vec3Array*>( geom.getNormalArray() );
+    if ( normals && normals->size()==numVertices && geom.getNormalBinding()==osg::Geometry::BIND_PER_VERTEX )
+        return normals;
+
+    normals = new osg::Vec3Array( numVertices );
+    geom.setNormalArray( normals );
+    geom.setNormalIndices( geom.getVertexIndices() );
+    geom.setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+    return normals;
+}
+
+bool NormalUpdater::build( osg::Geometry& geom )
+{
+    clear();
+
+    osg::Vec3Array *coords = dynamic_cast<osg::Vec3Array*>( geom.getVertexArray() );
+    if ( !coords || !coords->size() )
+    {
+        osg::notify(osg::WARN) << "osgModeling: Normals can only be updated with a Vec3Array of vertices." << std::endl;
+        return false;
+    }
+
+    _vertices = coords;
+    _groups.build( coords );
+
+    osg::TriangleFunctor<CollectTriangleFunctor> ctf;
+    ctf.setVerticsPtr( &(coords->front()), coords->size(), &_groups );
+    geom.accept( ctf );
+    _corners.swap( ctf._corners );
+
+    unsigned int numTriangles=_corners.size()/3, numGroups=_groups.getNumGroups();
+    const osg::Vec3Array* positions = _groups.getGroupPositions();
+    _groupPositions.assign( positions->begin(), positions->end() );
+    _faceNormals.resize( numTriangles );
+    _cornerWeights.resize( _corners.size() );
+    FaceNormalPass( &(_groupPositions.front()), _corners, _flip, _method, _faceNormals, _cornerWeights )( 0, numTriangles );
+    indexCornersByGroup( _corners, numGroups, _cornerOffsets, _groupCorners );
+
+    osg::Vec3Array* normals = getNormalArray( geom, coords->size() );
+    GatherNormalPass( _groups, _cornerOffsets, _groupCorners, _faceNormals, _cornerWeights, _threshold, *normals )( 0, numGroups );
+    normals->dirty();
+
+    _faceMarks.assign( numTriangles, 0 );
+    _groupMarks.assign( numGroups, 0 );
+    return true;
+}
+
+bool NormalUpdater::update( osg::Geometry& geom, const VECTOR<unsigned int>& dirtyVertices )
+{
+    osg::Vec3Array *coords = dynamic_cast<osg::Vec3Array*>( geom.getVertexArray() );
+    if ( !coords || coords!=_vertices.get() || coords->size()!=_groups.getNumVertices() )
+        return false;
+
+    osg::Vec3Array* normals = dynamic_cast<osg::Vec3Array*>( geom.getNormalArray() );
+    if ( !normals || normals->size()!=coords->size() )
+        return build( geom );
+
+    if ( ++_currentMark==0 )
+    {
+        _faceMarks.assign( _faceMarks.size(), 0 );
+        _groupMarks.assign( _groupMarks.size(), 0 );
+        _currentMark = 1;
+    }
+
+    // Find triangles around moved vertex groups.
+    VECTOR<unsigned int> dirtyFaces;
+    for ( unsigned int i=0; i<dirtyVertices.size(); ++i )
+    {
+        unsigned int vertex = dirtyVertices[i];
+        if ( vertex>=coords->size() ) continue;
+
+        unsigned int g = _groups.getGroup( vertex );
+        _groupPositions[g] = (*coords)[vertex];
+        for ( unsigned int j=_cornerOffsets[g]; j<_cornerOffsets[g+1]; ++j )
+        {
+            unsigned int f = _groupCorners[j]/3;
+            if ( _faceMarks[f]==_currentMark ) continue;
+            _faceMarks[f] = _currentMark;
+            dirtyFaces.push_back( f );
+        }
+    }
+    if ( !dirtyFaces.size() ) return true;
+
+    // Recompute these triangles, and then all vertex groups using them.
+    FaceNormalPass facePass( &(_groupPositions.front()), _corners, _flip, _method, _faceNormals, _cornerWeights );
+    GatherNormalPass gatherPass( _groups, _cornerOffsets, _groupCorners, _faceNormals, _cornerWeights, _threshold, *normals );
+    for ( unsigned int i=0; i<dirtyFaces.size(); ++i )
+        facePass.computeFace( dirtyFaces[i] );
+
+    for ( unsigned int i=0; i<dirtyFaces.size(); ++i )
+    {
+        for ( unsigned int j=0; j<3; ++j )
+        {
+            unsigned int g = _corners[3*dirtyFaces[i]+j];
+            if ( _groupMarks[g]==_currentMark ) continue;
+            _groupMarks[g] = _currentMark;
+            gatherPass.gatherGroup( g );
+        }
+    }
+    normals->dirty();
+    return true;
+}
@@ -140,38 +140,204 @@ void NurbsCurve::updateImplementation()
     setPath( pathArray.get() );
 }
 
+// Evaluates one point of a curve and its derivatives, using 'ders' as the buffer of basis functions.
+static bool evaluateCurvePoint( const osg::Vec3Array& ctrlPts, const osg::DoubleArray* weights, const double* knots,
+                                unsigned int degree, double u, double* ders,
+                                osg::Vec3& point, osg::Vec3* firstDer, osg::Vec3* secondDer )
+{
+    unsigned int numCtrl = ctrlPts.size(), order = degree+1;
+    unsigned int numDers = secondDer ? 2 : (firstDer ? 1 : 0);
+    unsigned int span = findKnotSpan( knots, degree, numCtrl, u );
+    if ( numDers ) calcBasisDerivatives( knots, span, degree, u, numDers, ders );
+    else calcBasisFunctions( knots, span, degree, u, ders );
+
+    // Blend homogeneous points and their derivatives.
+    osg::Vec4d blended[3];
+    for ( unsigned int k=0; k<order; ++k )
+    {
+        unsigned int i = span-degree+k;
+        double w = weights ? (*weights)[i] : 1.0;
+        const osg::Vec3& pt = ctrlPts[i];
+        osg::Vec4d ptAndWeight( pt.x()*w, pt.y()*w, pt.z()*w, w );
+        for ( unsigned int d=0; d<=numDers; ++d )
+            blended[d] += ptAndWeight * ders[d*order+k];
+    }
+
+    double w = blended[0].w();
+    if ( !w )
+    {
+        point.set( 0.0f, 0.0f, 0.0f );
+        if ( firstDer ) firstDer->set( 0.0f, 0.0f, 0.0f );
+        if ( secondDer ) secondDer->set( 0.0f, 0.0f, 0.0f );
+        return false;
+    }
+
+    // Derivatives of the rational curve C = A/w, from A' = C'w + Cw' and A'' = C''w + 2C'w' + Cw''.
+    osg::Vec3d c0 = osg::Vec3d(blended[0].x(), blended[0].y(), blended[0].z()) / w;
+    point = c0;
+    if ( numDers>0 )
+    {
+        osg::Vec3d c1 = (osg::Vec3d(blended[1].x(), blended[1].y(), blended[1].z()) - c0*blended[1].w()) / w;
+        if ( firstDer ) *firstDer = c1;
+        if ( numDers>1 )
+        {
+            osg::Vec3d c2 = (osg::Vec3d(blended[2].x(), blended[2].y(), blended[2].z())
+                - c1*(2.0*blended[1].w()) - c0*blended[2].w()) / w;
+            *secondDer = c2;
+        }
+    }
+    return true;
+}
+
+// Evaluates points of a curve in [begin, end) of the parameter list.
+static void evaluateCurvePoints( const osg::Vec3Array& ctrlPts, const osg::DoubleArray* weights, const double* knots,
+                                 unsigned int degree, const double* params, unsigned int begin, unsigned int end,
+                                 osg::Vec3* points, osg::Vec3* firstDers, osg::Vec3* secondDers )
+{
+    // Basis functions and derivatives are kept on the stack for usual degrees.
+    unsigned int order = degree+1;
+    double localBuffer[3*16];
+    std::vector<double> heapBuffer;
+    double* ders = localBuffer;
+    if ( order>16 )
+    {
+        heapBuffer.resize( 3*order );
+        ders = &(heapBuffer.front());
+    }
+
+    for ( unsigned int i=begin; i<end; ++i )
+    {
+        evaluateCurvePoint( ctrlPts, weights, knots, degree, params[i], ders, points[i],
+            firstDers ? firstDers+i : 0, secondDers ? secondDers+i : 0 );
+    }
+}
+
+struct EvaluateCurvePass
+{
+    const osg::Vec3Array& _ctrlPts;
+    const osg::DoubleArray* _weights;
+    const double* _knots;
+    unsigned int _degree;
+    const double* _params;
+    osg::Vec3 *_points, *_firstDers, *_secondDers;
+
+    EvaluateCurvePass( const osg::Vec3Array& ctrlPts, const osg::DoubleArray* weights, const double* knots,
+                       unsigned int degree, const double* params,
+                       osg::Vec3* points, osg::Vec3* firstDers, osg::Vec3* secondDers ):
+        _ctrlPts(ctrlPts), _weights(weights), _knots(knots), _degree(degree), _params(params),
+        _points(points), _firstDers(firstDers), _secondDers(secondDers) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        evaluateCurvePoints( _ctrlPts, _weights, _knots, _degree, _params, begin, end,
+            _points, _firstDers, _secondDers );
+    }
+};
+
+bool NurbsCurve::evaluate( double u, osg::Vec3& point, osg::Vec3* firstDer, osg::Vec3* secondDer ) const
+{
+    if ( !_ctrlPts || !_knots ) return false;
+
+    unsigned int numCtrl = _ctrlPts->size(), order = _degree+1;
+    if ( numCtrl<order || _knots->size()<numCtrl+order || (_weights.valid() && _weights->size()<numCtrl) )
+        return false;
+
+    double localBuffer[3*16];
+    std::vector<double> heapBuffer;
+    double* ders = localBuffer;
+    if ( order>16 )
+    {
+        heapBuffer.resize( 3*order );
+        ders = &(heapBuffer.front());
+    }
+    return evaluateCurvePoint( *_ctrlPts, _weights.get(), &(_knots->front()), _degree, u, ders,
+        point, firstDer, secondDer );
+}
+
+bool NurbsCurve::evaluate( const double* params, unsigned int num, osg::Vec3* points,
+                           osg::Vec3* firstDers, osg::Vec3* secondDers, TaskPool* pool, unsigned int grainSize ) const
+{
+    if ( !_ctrlPts || !_knots || (num && (!params || !points)) ) return false;
+
+    unsigned int numCtrl = _ctrlPts->size(), order = _degree+1;
+    if ( numCtrl<order || _knots->size()<numCtrl+order || (_weights.valid() && _weights->size()<numCtrl) )
+        return false;
+
+    EvaluateCurvePass pass( *_ctrlPts, _weights.get(), &(_knots->front()), _degree, params,
+        points, firstDers, secondDers );
+    TaskPool::parallelFor( pass, num, pool, grainSize );
+    return true;
+}
+
 void NurbsCurve::useCoxDeBoor( osg::Vec3Array* result )
 {
-    osg::ref_ptr<osg::DoubleArray> basisArray = new osg::DoubleArray;
-    unsigned int i, j;
+    unsigned int i, k, order=_degree+1;
     unsigned int numCtrl = _ctrlPts->size();
-    double u, min = (*_knots)[_degree];
-    double interval = ((*_knots)[numCtrl]-min)/(_numPath-1);
+    const double* knots = &(_knots->front());
+    double u, min = knots[_degree];
+    double interval = (knots[numCtrl]-min)/(_numPath-1);
+    VECTOR<double> basis( order );
+    result->reserve( result->size()+_numPath );
     for ( i=0; i<_numPath; ++i )
     {
         u = min + i*interval;
-        coxDeBoor( basisArray.get(), _degree+1, numCtrl, u );
+        unsigned int span = findKnotSpan( knots, _degree, numCtrl, u );
+        calcBasisFunctions( knots, span, _degree, u, &(basis.front()) );
+
+        // Only the degree+1 rational basis functions of the span are non-zero.
+        double sum = 0.0;
+        for ( k=0; k<order; ++k )
+        {
+            basis[k] *= (*_weights)[span-_degree+k];
+            sum += basis[k];
+        }
+        if ( sum ) sum = 1.0 / sum;
 
-        osg::Vec3 pathPoint;
-        for ( j=0; j<numCtrl; ++j )
-            pathPoint += (*_ctrlPts)[j] * (*basisArray)[j];
+        osg::Vec3d pathPoint;
+        for ( k=0; k<order; ++k )
+            pathPoint += osg::Vec3d((*_ctrlPts)[span-_degree+k]) * (basis[k]*sum);
         result->push_back( pathPoint );
     }
 }
 
 void NurbsCurve::useDeBoor( osg::Vec3Array* result )
 {
-    unsigned int i, s=_degree;
+    unsigned int i, j, r, s=_degree, order=_degree+1;
     unsigned int numCtrl = _ctrlPts->size();
-    double u, min = (*_knots)[_degree];
-    double interval = ((*_knots)[numCtrl]-min)/(_numPath-1);
+    const double* knots = &(_knots->front());
+    double u, min = knots[_degree];
+    double interval = (knots[numCtrl]-min)/(_numPath-1);
+    VECTOR<osg::Vec4d> points( order );
+    result->reserve( result->size()+_numPath );
     for ( i=0; i<_numPath; ++i )
     {
+        // Samples are ascending, so search from the current span only if leaving it.
         u = min + i*interval;
-        while ( u>(*_knots)[s+1] && s<numCtrl-1 ) ++s;
+        if ( u>knots[s+1] ) s = findKnotSpan( knots, _degree, numCtrl, u );
 
-        osg::Vec4 ptAndWeight;
-        ptAndWeight = lerpRecursion( _degree, _degree, s, u );
+        for ( j=0; j<order; ++j )
+        {
+            unsigned int index = s-_degree+j;
+            double w = (*_weights)[index];
+            const osg::Vec3& pt = (*_ctrlPts)[index];
+            points[j].set( pt.x()*w, pt.y()*w, pt.z()*w, w );
+        }
+
+        // Interpolate in place, from the highest point so lower ones of the last level are still available.
+        for ( r=1; r<=_degree; ++r )
+        {
+            for ( j=_degree; j>=r; --j )
+            {
+                unsigned int index = s-_degree+j;
+                double delta = u - knots[index];
+                double base = knots[index+_degree-r+1] - knots[index];
+                if ( base ) delta /= base;
+                else delta = 0.0f;
+                points[j] = lerp( points[j-1], points[j], delta );
+            }
+        }
+
+        const osg::Vec4d& ptAndWeight = points[_degree];
         if ( ptAndWeight.w() )
         {
             result->push_back( osg::Vec3(
@@ -183,74 +349,3 @@ void NurbsCurve::useDeBoor( osg::Vec3Array* result )
             result->push_back( osg::Vec3(0.0f, 0.0f, 0.0f) );
     }
 }
-
-void NurbsCurve::coxDeBoor( osg::DoubleArray* basis, int m, int num, double u )
-{
-    int i, j;
-    basis->resize( 0 );
-
-    // Define first-order basis functions.
-    for ( i=0; i<m+num-1; ++i )
-    {
-        if ( u>=(*_knots)[i] && u<(*_knots)[i+1] )
-            basis->push_back( 1.0f );
-        else
-            basis->push_back( 0.0f );
-    }
-
-    // Calculate higher-order basis functions.
-    double base, n1, n2;
-    for ( i=2; i<=m; ++i )
-    {
-        for ( j=0; j<num+m-i; ++j )
-        {
-            if ( (*basis)[j] )
-            {
-                base = (*_knots)[j+i-1] - (*_knots)[j];
-                if ( !base ) n1 = 0.0f;
-                else n1 = (*basis)[j] * (u - (*_knots)[j])/base;
-            }
-            else
-                n1 = 0.0f;
-
-            if ( (*basis)[j+1] )
-            {
-                base = (*_knots)[j+i] - (*_knots)[j+1];
-                if ( !base ) n2 = 0.0f;
-                else n2 = (*basis)[j+1] * ((*_knots)[j+i] - u)/base;
-            }
-            else
-                n2 = 0.0f;
-
-            (*basis)[j] = n1 + n2;
-        }
-    }
-    if ( u==(*_knots)[num+m-1] )
-        (*basis)[num-1] = 1.0f;
-
-    // Calculate summary.
-    double sum=0.0f;
-    for ( i=0; i<num; ++i )
-        sum += (*basis)[i] * (*_weights)[i];
-    if ( !sum ) return;
-    sum = 1.0f / sum;
-
-    // Set basis functions
-    for ( i=0; i<num; ++i )
-        (*basis)[i] *= (*_weights)[i] * sum;
-}
-
-osg::Vec4 NurbsCurve::lerpRecursion( unsigned int k, unsigned int r, unsigned int i, double u )
-{
-    if ( r==0 )
-        return osg::Vec4( (*_ctrlPts)[i] * (*_weights)[i], (*_weights)[i] );
-
-    double delta = u - (*_knots)[i];
-    double base = (*_knots)[i+k-r+1] - (*_knots)[i];
-    if ( base ) delta /= base;
-    else delta = 0.0f;
-
-    return lerp( lerpRecursion(k, r-1, i-1, u),
-        lerpRecursion(k, r-1, i, u),
-        delta );
-}
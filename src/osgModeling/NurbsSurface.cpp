@@ -126,6 +126,12 @@ void NurbsSurface::updateImplementation()
         osg::notify(osg::WARN) << "osgModeling: No enough control points for creating NURBS surfaces." << std::endl;
         return;
     }
+    else if ( _ctrlPts->size()<(_knotsU->size()-_degreeU-1)*(_knotsV->size()-_degreeV-1)
+        || _weights->size()<_ctrlPts->size() )
+    {
+        osg::notify(osg::WARN) << "osgModeling: Control points or weights of a NURBS surface don't match the knots." << std::endl;
+        return;
+    }
 
     // Initiate vertics & texture coordinates.
     osg::ref_ptr<osg::Vec3Array> vertics = new osg::Vec3Array;
@@ -191,27 +197,186 @@ void NurbsSurface::updateImplementation()
     dirtyDisplayList();
 }
 
+// Evaluates points of a surface with partial derivatives and normals in [begin, end) of the parameter list.
+struct EvaluateSurfacePass
+{
+    const osg::Vec3Array& _ctrlPts;
+    const osg::DoubleArray* _weights;
+    const double *_knotsU, *_knotsV;
+    unsigned int _degreeU, _degreeV, _numRows, _numCols;
+    const double *_u, *_v;
+    osg::Vec3 *_points, *_uDers, *_vDers, *_normals;
+
+    EvaluateSurfacePass( const osg::Vec3Array& ctrlPts, const osg::DoubleArray* weights,
+                         const double* knotsU, const double* knotsV, unsigned int degreeU, unsigned int degreeV,
+                         unsigned int numRows, unsigned int numCols, const double* u, const double* v,
+                         osg::Vec3* points, osg::Vec3* uDers, osg::Vec3* vDers, osg::Vec3* normals ):
+        _ctrlPts(ctrlPts), _weights(weights), _knotsU(knotsU), _knotsV(knotsV), _degreeU(degreeU), _degreeV(degreeV),
+        _numRows(numRows), _numCols(numCols), _u(u), _v(v),
+        _points(points), _uDers(uDers), _vDers(vDers), _normals(normals) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        // Basis functions and first derivatives are kept on the stack for usual degrees.
+        unsigned int orderU=_degreeU+1, orderV=_degreeV+1;
+        unsigned int numDers = (_uDers || _vDers || _normals) ? 1 : 0;
+        double localBuffer[2*16*2];
+        std::vector<double> heapBuffer;
+        double* dersU = localBuffer;
+        double* dersV = localBuffer + 2*16;
+        if ( orderU>16 || orderV>16 )
+        {
+            heapBuffer.resize( 2*(orderU+orderV) );
+            dersU = &(heapBuffer.front());
+            dersV = dersU + 2*orderU;
+        }
+
+        for ( unsigned int i=begin; i<end; ++i )
+        {
+            double u=_u[i], v=_v[i];
+            unsigned int spanU = findKnotSpan( _knotsU, _degreeU, _numRows, u );
+            unsigned int spanV = findKnotSpan( _knotsV, _degreeV, _numCols, v );
+            if ( numDers )
+            {
+                calcBasisDerivatives( _knotsU, spanU, _degreeU, u, 1, dersU );
+                calcBasisDerivatives( _knotsV, spanV, _degreeV, v, 1, dersV );
+            }
+            else
+            {
+                calcBasisFunctions( _knotsU, spanU, _degreeU, u, dersU );
+                calcBasisFunctions( _knotsV, spanV, _degreeV, v, dersV );
+            }
+
+            // Blend each control row of the span in V first, and then blend rows in U.
+            osg::Vec4d blended, blendedU, blendedV;
+            for ( unsigned int k=0; k<orderU; ++k )
+            {
+                unsigned int index = (spanU-_degreeU+k)*_numCols + spanV-_degreeV;
+                osg::Vec4d row, rowV;
+                for ( unsigned int l=0; l<orderV; ++l, ++index )
+                {
+                    double w = _weights ? (*_weights)[index] : 1.0;
+                    const osg::Vec3& pt = _ctrlPts[index];
+                    osg::Vec4d ptAndWeight( pt.x()*w, pt.y()*w, pt.z()*w, w );
+                    row += ptAndWeight * dersV[l];
+                    if ( numDers ) rowV += ptAndWeight * dersV[orderV+l];
+                }
+
+                blended += row * dersU[k];
+                if ( numDers )
+                {
+                    blendedU += row * dersU[orderU+k];
+                    blendedV += rowV * dersU[k];
+                }
+            }
+
+            double w = blended.w();
+            if ( !w )
+            {
+                _points[i].set( 0.0f, 0.0f, 0.0f );
+                if ( _uDers ) _uDers[i].set( 0.0f, 0.0f, 0.0f );
+                if ( _vDers ) _vDers[i].set( 0.0f, 0.0f, 0.0f );
+                if ( _normals ) _normals[i].set( 0.0f, 0.0f, 0.0f );
+                continue;
+            }
+
+            // Partial derivatives of the rational surface S = A/w, from A' = S'w + Sw'.
+            osg::Vec3d s0 = osg::Vec3d(blended.x(), blended.y(), blended.z()) / w;
+            _points[i] = s0;
+            if ( !numDers ) continue;
+
+            osg::Vec3d su = (osg::Vec3d(blendedU.x(), blendedU.y(), blendedU.z()) - s0*blendedU.w()) / w;
+            osg::Vec3d sv = (osg::Vec3d(blendedV.x(), blendedV.y(), blendedV.z()) - s0*blendedV.w()) / w;
+            if ( _uDers ) _uDers[i] = su;
+            if ( _vDers ) _vDers[i] = sv;
+            if ( _normals )
+            {
+                osg::Vec3d normal = su ^ sv;
+                double length = normal.length();
+                if ( length>0.0 ) normal /= length;
+                _normals[i] = normal;
+            }
+        }
+    }
+};
+
+bool NurbsSurface::evaluate( const double* u, const double* v, unsigned int num, osg::Vec3* points,
+                             osg::Vec3* uDers, osg::Vec3* vDers, osg::Vec3* normals,
+                             TaskPool* pool, unsigned int grainSize ) const
+{
+    if ( !_ctrlPts || !_knotsU || !_knotsV || (num && (!u || !v || !points)) ) return false;
+    if ( _knotsU->size()<=_degreeU+1 || _knotsV->size()<=_degreeV+1 ) return false;
+
+    // Dimensions of control points are decided by knots, as update() does.
+    unsigned int numRows = _knotsU->size()-_degreeU-1;
+    unsigned int numCols = _knotsV->size()-_degreeV-1;
+    if ( numRows<_degreeU+1 || numCols<_degreeV+1 || _ctrlPts->size()<numRows*numCols
+        || (_weights.valid() && _weights->size()<numRows*numCols) )
+        return false;
+
+    EvaluateSurfacePass pass( *_ctrlPts, _weights.get(), &(_knotsU->front()), &(_knotsV->front()),
+        _degreeU, _degreeV, numRows, numCols, u, v, points, uDers, vDers, normals );
+    TaskPool::parallelFor( pass, num, pool, grainSize );
+    return true;
+}
+
 void NurbsSurface::useDeBoor( osg::Vec3Array* result )
 {
-    unsigned int m, n;
+    unsigned int m, n, k;
     double minU=(*_knotsU)[_degreeU], minV=(*_knotsV)[_degreeV];
     double intervalU = ((*_knotsU)[_ctrlRow+_degreeU]-minU)/(_numPathU-1);
     double intervalV = ((*_knotsV)[_ctrlCol+_degreeV]-minV)/(_numPathV-1);
+    const double* knotsU = &(_knotsU->front());
+    const double* knotsV = &(_knotsV->front());
+    unsigned int orderU=_degreeU+1, orderV=_degreeV+1;
+
+    // Basis functions of each column are shared by all rows, so tabulate them first.
+    VECTOR<unsigned int> spansV( _numPathV );
+    VECTOR<double> basisV( _numPathV*orderV );
+    for ( n=0; n<_numPathV; ++n )
+    {
+        double v = minV + n*intervalV;
+        spansV[n] = findKnotSpan( knotsV, _degreeV, _ctrlCol, v );
+        calcBasisFunctions( knotsV, spansV[n], _degreeV, v, &(basisV[n*orderV]) );
+    }
+
+    // Homogeneous control points.
+    VECTOR<osg::Vec4d> ctrlPts( _ctrlRow*_ctrlCol );
+    for ( k=0; k<ctrlPts.size(); ++k )
+    {
+        double w = (*_weights)[k];
+        const osg::Vec3& pt = (*_ctrlPts)[k];
+        ctrlPts[k].set( pt.x()*w, pt.y()*w, pt.z()*w, w );
+    }
 
-    unsigned int s = _degreeU;
+    // For each row, blend control rows of the U span into one row first, and then blend
+    // the V span of that row for each column.
+    VECTOR<double> basisU( orderU );
+    VECTOR<osg::Vec4d> rowPts( _ctrlCol );
+    result->reserve( result->size()+_numPathU*_numPathV );
     for ( m=0; m<_numPathU; ++m )
     {
         double u = minU + m*intervalU;
-        while ( u>(*_knotsU)[s+1] && s<_ctrlRow-1 ) ++s;
+        unsigned int s = findKnotSpan( knotsU, _degreeU, _ctrlRow, u );
+        calcBasisFunctions( knotsU, s, _degreeU, u, &(basisU.front()) );
+
+        for ( n=0; n<_ctrlCol; ++n )
+        {
+            osg::Vec4d pt(0.0, 0.0, 0.0, 0.0);
+            const osg::Vec4d* column = &(ctrlPts[(s-_degreeU)*_ctrlCol+n]);
+            for ( k=0; k<orderU; ++k, column+=_ctrlCol )
+                pt += (*column) * basisU[k];
+            rowPts[n] = pt;
+        }
 
-        unsigned int t = _degreeV;
         for ( n=0; n<_numPathV; ++n )
         {
-            double v = minV + n*intervalV;
-            while ( v>(*_knotsV)[t+1] && t<_ctrlCol-1 ) ++t;
+            osg::Vec4d ptAndWeight(0.0, 0.0, 0.0, 0.0);
+            const osg::Vec4d* row = &(rowPts[spansV[n]-_degreeV]);
+            const double* basis = &(basisV[n*orderV]);
+            for ( k=0; k<orderV; ++k )
+                ptAndWeight += row[k] * basis[k];
 
-            osg::Vec4 ptAndWeight;
-            ptAndWeight = lerpRecursion( _degreeU, _degreeV, s, t, u, v );
             if ( ptAndWeight.w() )
             {
                 result->push_back( osg::Vec3(
@@ -224,40 +389,3 @@ void NurbsSurface::useDeBoor( osg::Vec3Array* result )
         }
     }
 }
-
-osg::Vec4 NurbsSurface::lerpRecursion( osg::DoubleArray* knots, unsigned int knotPos,
-                                      unsigned int k, unsigned int r, unsigned int i, double u )
-{
-    if ( r==0 )
-        return osg::Vec4( (*_ctrlPts)[i] * (*_weights)[i], (*_weights)[i] );
-
-    double delta = u - (*knots)[knotPos];
-    double base = (*knots)[knotPos+k-r+1] - (*knots)[knotPos];
-    if ( base ) delta /= base;
-    else delta = 0.0f;
-
-    return lerp( lerpRecursion(knots, knotPos-1, k, r-1, i-1, u),
-        lerpRecursion(knots, knotPos, k, r-1, i, u),
-        delta );
-}
-
-osg::Vec4 NurbsSurface::lerpRecursion( unsigned int r, unsigned int s,
-                                      unsigned int i, unsigned int j,
-                                      double u, double v )
-{
-    unsigned int pos = i*_ctrlCol + j;
-    if ( r==0 && s==0 ) return osg::Vec4( (*_ctrlPts)[pos] * (*_weights)[pos], (*_weights)[pos] );
-    else if ( r==0 ) return lerpRecursion( _knotsV.get(), j, _degreeV, s, pos, v );
-    else if ( s==0 ) return lerpRecursion( _knotsU.get(), i, _degreeU, r, pos, u );
-
-    double a = u - (*_knotsU)[i], b = v - (*_knotsV)[j], base;
-    if ( 0.0f!=(base=(*_knotsU)[i+_degreeU+1-r] - (*_knotsU)[i]) ) a /= base;
-    else a = 0.0f;
-    if ( 0.0f!=(base=(*_knotsV)[j+_degreeV+1-s] - (*_knotsV)[j]) ) b /= base;
-    else b = 0.0f;
-
-    return lerpRecursion(r-1, s-1, i-1, j-1, u, v) * (1-a) * (1-b) +
-        lerpRecursion(r-1, s-1, i-1, j, u, v) * (1-a) * b +
-        lerpRecursion(r-1, s-1, i, j-1, u, v) * a * (1-b) +
-        lerpRecursion(r-1, s-1, i, j, u, v) * a * b;
-}
@@ -21,6 +21,7 @@
 #include <osgModeling/PolyMesh>
 #include <osgModeling/ModelVisitor>
 #include <osgModeling/NormalVisitor>
+#include <osgModeling/VertexWelder>
 
 using namespace osgModeling;
 
@@ -60,6 +61,7 @@ bool PolyMesh::Edge::hasFace( PolyMesh::Face* f, bool addIfNotFound )
 PolyMesh::Face::Face( osg::Vec3Array* array, int p1, int p2, int p3, int f ):
     _flag(f), _array(array)
 {
+    _pts.reserve( 3 );
     _pts.push_back( p1 );
     _pts.push_back( p2 );
     _pts.push_back( p3 );
@@ -93,19 +95,23 @@ osg::Vec3 PolyMesh::Face::operator-( PolyMesh::Edge e )
 }
 
 PolyMesh::PolyMesh():
-    osg::Geometry()
+    osg::Geometry(),
+    _topologyStorage(EDGE_MAP_TOPOLOGY), _adjacencyNumEdges(0), _adjacencyDirty(true)
 {
 }
 
-PolyMesh::PolyMesh( const osg::Geometry& copy, const osg::CopyOp& copyop ):
-    osg::Geometry(copy,copyop)
+PolyMesh::PolyMesh( const osg::Geometry& copy, const osg::CopyOp& copyop, TopologyStorage ts ):
+    osg::Geometry(copy,copyop),
+    _topologyStorage(ts), _adjacencyNumEdges(0), _adjacencyDirty(true)
 {
     ModelVisitor::buildMesh( *this );
 }
 
 PolyMesh::PolyMesh( const PolyMesh& copy, const osg::CopyOp& copyop ):
     osg::Geometry(copy,copyop),
-    _edges(copy._edges), _faces(copy._faces)
+    _edges(copy._edges), _faces(copy._faces),
+    _topologyStorage(copy._topologyStorage), _halfEdgeMesh(copy._halfEdgeMesh),
+    _adjacencyNumEdges(0), _adjacencyDirty(true)
 {
 }
 
@@ -116,6 +122,13 @@ PolyMesh::~PolyMesh()
 
 PolyMesh::MeshType PolyMesh::getType()
 {
+    if ( _halfEdgeMesh.valid() )
+    {
+        if ( !_halfEdgeMesh->getNumFaces() ) return INVALID_MESH;
+        else if ( _halfEdgeMesh->getNumJunctionHalfEdges() ) return NONMANIFOLD_MESH;
+        return (_halfEdgeMesh->getNumBorderHalfEdges()?OPEN_MESH:CLOSED_MESH);
+    }
+
     bool closed=true;
     for ( EdgeMap::iterator itr=_edges.begin(); itr!=_edges.end(); ++itr )
     {
@@ -150,6 +163,74 @@ void PolyMesh::destroyMesh()
             itr = _faces.erase( itr );
         }
     }
+    _halfEdgeMesh = NULL;
+    dirtyAdjacency();
+}
+
+HalfEdgeMesh* PolyMesh::createHalfEdgeMesh()
+{
+    osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( getVertexArray() );
+    if ( !vertices ) return NULL;
+
+    HalfEdgeMesh::IndexList faceSizes, faceIndices;
+    faceSizes.reserve( _faces.size() );
+    faceIndices.reserve( _faces.size()*3 );
+    for ( FaceList::iterator itr=_faces.begin(); itr!=_faces.end(); ++itr )
+    {
+        faceSizes.push_back( (*itr)->_pts.size() );
+        faceIndices.insert( faceIndices.end(), (*itr)->_pts.begin(), (*itr)->_pts.end() );
+    }
+
+    osg::ref_ptr<HalfEdgeMesh> halfEdgeMesh = new HalfEdgeMesh;
+    if ( !halfEdgeMesh->build(vertices, faceSizes, faceIndices) )
+    {
+        osg::notify(osg::WARN) << "osgModeling: Failed to build half-edges of the polymesh." << std::endl;
+        return NULL;
+    }
+    return halfEdgeMesh.release();
+}
+
+bool PolyMesh::buildHalfEdges()
+{
+    _halfEdgeMesh = createHalfEdgeMesh();
+    return _halfEdgeMesh.valid();
+}
+
+bool PolyMesh::rebuildTopology()
+{
+    for ( EdgeMap::iterator itr=_edges.begin(); itr!=_edges.end(); ++itr )
+        delete itr->second;
+    _edges.clear();
+    dirtyAdjacency();
+
+    if ( !buildHalfEdges() ) return false;
+    if ( _topologyStorage==EDGE_MAP_TOPOLOGY )
+    {
+        buildEdgeMap();
+        _halfEdgeMesh = NULL;
+    }
+    return true;
+}
+
+void PolyMesh::buildEdgeMap()
+{
+    if ( !_halfEdgeMesh.valid() || !_edges.empty() ) return;
+    buildEdges( _halfEdgeMesh.get(), _faces, _edges );
+    dirtyAdjacency();
+}
+
+unsigned int PolyMesh::findFaceIndex( Face* f ) const
+{
+    if ( !_halfEdgeMesh.valid() || !f || f->_pts.size()<2 ) return HalfEdgeMesh::INVALID_INDEX;
+
+    // Find the face from its first half-edge, which is unique unless on a junction.
+    unsigned int v0 = _halfEdgeMesh->getVertex( f->_pts[0] ), v1 = _halfEdgeMesh->getVertex( f->_pts[1] );
+    unsigned int h = _halfEdgeMesh->findHalfEdge( v0, v1 );
+    if ( h!=HalfEdgeMesh::INVALID_INDEX && _faces[_halfEdgeMesh->getFace(h)]==f )
+        return _halfEdgeMesh->getFace( h );
+
+    FaceList::const_iterator itr = std::find( _faces.begin(), _faces.end(), f );
+    return itr!=_faces.end() ? (unsigned int)(itr-_faces.begin()) : HalfEdgeMesh::INVALID_INDEX;
 }
 
 void PolyMesh::subdivide( Subdivision* subd )
@@ -171,31 +252,122 @@ PolyMesh::Edge* PolyMesh::getEdge( osg::Vec3 p1, osg::Vec3 p2, EdgeMap& emap )
     else return emap[p];
 }
 
+void PolyMesh::buildAdjacency()
+{
+    if ( !_adjacencyDirty && _adjacencyNumEdges==_edges.size() ) return;
+
+    // Weld edge points with the same epsilon as equivalent(), and count edges of each vertex.
+    // An edge is only attached once if both points are welded together.
+    unsigned int numEdges = _edges.size();
+    std::vector<unsigned int> edgeVertices( numEdges*2 );
+    _adjacencyWelder.reset( 1e-6, numEdges );
+    _adjacencyOffsets.clear();
+    _adjacencyOffsets.push_back( 0 );
+    unsigned int i = 0;
+    for ( EdgeMap::iterator itr=_edges.begin(); itr!=_edges.end(); ++itr, i+=2 )
+    {
+        edgeVertices[i] = _adjacencyWelder.weld( itr->first.first );
+        edgeVertices[i+1] = _adjacencyWelder.weld( itr->first.second );
+        _adjacencyOffsets.resize( _adjacencyWelder.getNumVertices()+1, 0 );
+        _adjacencyOffsets[edgeVertices[i]+1]++;
+        if ( edgeVertices[i+1]!=edgeVertices[i] ) _adjacencyOffsets[edgeVertices[i+1]+1]++;
+    }
+    for ( i=1; i<_adjacencyOffsets.size(); ++i ) _adjacencyOffsets[i] += _adjacencyOffsets[i-1];
+
+    // Fill edges in the map order, which is the same order of traversing the map. Other points of edges are
+    // taken from map keys, as spinEdge() only changes keys of edges.
+    std::vector<unsigned int> fillPos( _adjacencyOffsets.begin(), _adjacencyOffsets.end()-1 );
+    _adjacentEdges.resize( _adjacencyOffsets.back() );
+    _adjacentPoints.resize( _adjacencyOffsets.back() );
+    i = 0;
+    for ( EdgeMap::iterator itr=_edges.begin(); itr!=_edges.end(); ++itr, i+=2 )
+    {
+        unsigned int pos = fillPos[edgeVertices[i]]++;
+        _adjacentEdges[pos] = itr->second;
+        _adjacentPoints[pos] = itr->first.second;
+        if ( edgeVertices[i+1]==edgeVertices[i] ) continue;
+
+        pos = fillPos[edgeVertices[i+1]]++;
+        _adjacentEdges[pos] = itr->second;
+        _adjacentPoints[pos] = itr->first.first;
+    }
+
+    _adjacencyNumEdges = numEdges;
+    _adjacencyDirty = false;
+}
+
+bool PolyMesh::findAdjacency( const osg::Vec3& p, unsigned int& begin, unsigned int& end )
+{
+    buildAdjacency();
+    unsigned int v = _adjacencyWelder.find( p );
+    if ( v==VertexWelder::INVALID_INDEX ) return false;
+
+    begin = _adjacencyOffsets[v];
+    end = _adjacencyOffsets[v+1];
+    return true;
+}
+
 void PolyMesh::findEdgeList( osg::Vec3 p, EdgeList& elist )
 {
-    for ( EdgeMap::iterator itr=_edges.begin(); itr!=_edges.end(); ++itr )
+    if ( _halfEdgeMesh.valid() )
     {
-        if ( equivalent(itr->first.first,p) || equivalent(itr->first.second,p) )
-            elist.push_back( itr->second );
+        HalfEdgeMesh::IndexList neighbors;
+        _halfEdgeMesh->findNeighbors( _halfEdgeMesh->findVertex(p), neighbors );
+        buildEdgeMap();
+        for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+        {
+            Edge* edge = getEdge( p, _halfEdgeMesh->getPosition(*itr), _edges );
+            if ( edge ) elist.push_back( edge );
+        }
+        return;
     }
+
+    unsigned int begin=0, end=0;
+    if ( findAdjacency(p, begin, end) )
+        elist.insert( elist.end(), _adjacentEdges.begin()+begin, _adjacentEdges.begin()+end );
 }
 
 void PolyMesh::findEdgeList( Edge* e, EdgeList& elist0, EdgeList& elist1 )
 {
     osg::Vec3 v0=(*e)[0], v1=(*e)[1];
-    for ( EdgeMap::iterator itr=_edges.begin(); itr!=_edges.end(); ++itr )
+    if ( _halfEdgeMesh.valid() )
     {
-        if ( e==itr->second ) continue;
+        buildEdgeMap();
+        for ( unsigned int i=0; i<2; ++i )
+        {
+            osg::Vec3 v = (*e)[i], other = (*e)[1-i];
+            HalfEdgeMesh::IndexList neighbors;
+            _halfEdgeMesh->findNeighbors( _halfEdgeMesh->findVertex(v), neighbors );
+            for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+            {
+                osg::Vec3 p = _halfEdgeMesh->getPosition( *itr );
+                Edge* edge = (p==other) ? NULL : getEdge( v, p, _edges );
+                if ( edge ) (i ? elist1 : elist0).push_back( edge );
+            }
+        }
+        return;
+    }
 
-        if ( equivalent(itr->first.first,v0) || equivalent(itr->first.second,v0) )
-            elist0.push_back( itr->second );
-        else if ( equivalent(itr->first.first,v1) || equivalent(itr->first.second,v1) )
-            elist1.push_back( itr->second );
+    unsigned int begin=0, end=0;
+    if ( findAdjacency(v0, begin, end) )
+    {
+        for ( unsigned int i=begin; i<end; ++i )
+        {
+            if ( _adjacentEdges[i]!=e ) elist0.push_back( _adjacentEdges[i] );
+        }
+    }
+    if ( findAdjacency(v1, begin, end) )
+    {
+        for ( unsigned int i=begin; i<end; ++i )
+        {
+            if ( _adjacentEdges[i]!=e && !equivalent(_adjacentPoints[i],v0) ) elist1.push_back( _adjacentEdges[i] );
+        }
     }
 }
 
 void PolyMesh::findEdgeList( Face* f, EdgeList& elist )
 {
+    buildEdgeMap();
     unsigned int size = f->_pts.size();
     for ( unsigned int i=0; i<size; ++i )
     {
@@ -206,17 +378,31 @@ void PolyMesh::findEdgeList( Face* f, EdgeList& elist )
 
 void PolyMesh::findNeighbors( osg::Vec3 p, VertexList& vlist )
 {
-    for ( EdgeMap::iterator itr=_edges.begin(); itr!=_edges.end(); ++itr )
+    if ( _halfEdgeMesh.valid() )
     {
-        if ( equivalent(itr->first.first,p) )
-            vlist.push_back( itr->first.second );
-        else if ( equivalent(itr->first.second,p) )
-            vlist.push_back( itr->first.first );
+        HalfEdgeMesh::IndexList neighbors;
+        _halfEdgeMesh->findNeighbors( _halfEdgeMesh->findVertex(p), neighbors );
+        for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+            vlist.push_back( _halfEdgeMesh->getPosition(*itr) );
+        return;
     }
+
+    unsigned int begin=0, end=0;
+    if ( !findAdjacency(p, begin, end) ) return;
+    vlist.insert( vlist.end(), _adjacentPoints.begin()+begin, _adjacentPoints.begin()+end );
 }
 
 void PolyMesh::findNeighbors( Face* f, FaceList& flist )
 {
+    if ( _halfEdgeMesh.valid() )
+    {
+        HalfEdgeMesh::IndexList neighbors;
+        _halfEdgeMesh->findFaceNeighbors( findFaceIndex(f), neighbors );
+        for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+            flist.push_back( _faces[*itr] );
+        return;
+    }
+
     unsigned int size = f->_pts.size();
     for ( unsigned int i=0; i<size; ++i )
     {
@@ -233,19 +419,37 @@ void PolyMesh::findNeighbors( Face* f, FaceList& flist )
     }
 }
 
-bool PolyMesh::convertFacesToGeometry( FaceList faces, osg::Geometry* geom )
+bool PolyMesh::convertFacesToGeometry( FaceList faces, osg::Geometry* geom, double weldTolerance )
 {
     if ( !faces.size() || !geom ) return false;
 
+    // Map every vertex to the first one it is welded with. The vertex array itself is kept unchanged,
+    // as faces of the mesh still refer to it.
+    std::vector<unsigned int> weldMap;
+    osg::Vec3Array* vertices = faces.front()->_array;
+    if ( vertices && weldTolerance>0.0 )
+    {
+        VertexWelder welder( weldTolerance, vertices->size() );
+        std::vector<unsigned int> firstIndices;
+        weldMap.resize( vertices->size() );
+        for ( unsigned int i=0; i<vertices->size(); ++i )
+        {
+            unsigned int index = welder.weld( (*vertices)[i] );
+            if ( index==firstIndices.size() ) firstIndices.push_back( i );
+            weldMap[i] = firstIndices[index];
+        }
+    }
+
     osg::ref_ptr<osg::DrawElementsUInt> indices = new osg::DrawElementsUInt( osg::PrimitiveSet::TRIANGLES, 0 );
+    indices->reserve( faces.size()*3 );
 
-    unsigned int i, index=0, firstIndex=0, lastIndex=0;
+    unsigned int i, firstIndex=0, lastIndex=0;
     for ( FaceList::iterator itr=faces.begin();
         itr!=faces.end();
         ++itr )
     {
-        Face f = *(*itr);
-        unsigned int size=f._pts.size();
+        Face* f = *itr;
+        unsigned int size=f->_pts.size();
         for ( i=0; i<size; ++i )
         {
             if ( i>2 )
@@ -254,13 +458,13 @@ bool PolyMesh::convertFacesToGeometry( FaceList faces, osg::Geometry* geom )
                 indices->push_back( lastIndex );
             }
 
-            indices->push_back( f(i) );
+            unsigned int index = (*f)(i);
+            indices->push_back( index<weldMap.size() ? weldMap[index] : index );
 
             if ( !i ) firstIndex = indices->back();
             lastIndex = indices->back();
         }
     }
-
     geom->removePrimitiveSet( 0, geom->getPrimitiveSetList().size() );
     geom->addPrimitiveSet( indices.get() );
     geom->setTexCoordArray( 0, NULL );	// TEMP
@@ -328,6 +532,27 @@ PolyMesh::Edge* PolyMesh::spinEdge( EdgeMap::iterator& emap_itr, EdgeMap& emap )
     return e;
 }
 
+void PolyMesh::buildEdges( const HalfEdgeMesh* hem, const FaceList& faces, EdgeMap& emap )
+{
+    if ( !hem || hem->getNumFaces()!=faces.size() ) return;
+
+    // Junction half-edges have no twins, so each of them adds its face to the shared edge.
+    unsigned int numHalfEdges = hem->getNumHalfEdges();
+    for ( unsigned int h=0; h<numHalfEdges; ++h )
+    {
+        unsigned int twin = hem->getTwin( h );
+        if ( twin!=HalfEdgeMesh::INVALID_INDEX && twin<h ) continue;
+
+        Segment p = getSegment( hem->getPosition(hem->getOrigin(h)), hem->getPosition(hem->getTarget(h)) );
+        EdgeMap::iterator itr = emap.find( p );
+        if ( itr==emap.end() )
+            itr = emap.insert( EdgeMap::value_type(p, new Edge(p.first, p.second)) ).first;
+        itr->second->hasFace( faces[hem->getFace(h)], true );
+        if ( twin!=HalfEdgeMesh::INVALID_INDEX )
+            itr->second->hasFace( faces[hem->getFace(twin)], true );
+    }
+}
+
 void PolyMesh::buildEdges( Face* f, osg::Vec3Array* refArray, EdgeMap& emap )
 {
     osg::Vec3 p1, p2;
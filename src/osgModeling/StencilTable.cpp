@@ -0,0 +1,181 @@
+/* -*-c++-*- osgModeling - Copyright (C) 2008 Wang Rui <wangray84@gmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <algorithm>
+#include <osg/Notify>
+#include <osgModeling/StencilTable>
+
+using namespace osgModeling;
+
+/** Pass applying a range of stencils. */
+struct ApplyStencilsPass
+{
+    const StencilTable& _table;
+    const osg::Vec3Array& _sources;
+    osg::Vec3Array& _results;
+
+    ApplyStencilsPass( const StencilTable& table, const osg::Vec3Array& sources, osg::Vec3Array& results ):
+        _table(table), _sources(sources), _results(results) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        const StencilTable::IndexList& offsets = _table.getOffsets();
+        const StencilTable::IndexList& indices = _table.getIndices();
+        const StencilTable::WeightList& weights = _table.getWeights();
+        for ( unsigned int i=begin; i<end; ++i )
+        {
+            float x=0.0f, y=0.0f, z=0.0f;
+            for ( unsigned int j=offsets[i]; j<offsets[i+1]; ++j )
+            {
+                const osg::Vec3& p = _sources[indices[j]];
+                float w = weights[j];
+                x += p.x()*w; y += p.y()*w; z += p.z()*w;
+            }
+            _results[i].set( x, y, z );
+        }
+    }
+};
+
+StencilTable::StencilTable( unsigned int numSources ):
+    osg::Referenced()
+{
+    clear( numSources );
+}
+
+void StencilTable::clear( unsigned int numSources )
+{
+    _numSources = numSources;
+    _offsets.clear();
+    _offsets.push_back( 0 );
+    _indices.clear();
+    _weights.clear();
+}
+
+void StencilTable::multiply( const StencilTable& lhs, const StencilTable& rhs )
+{
+    clear( rhs._numSources );
+
+    // Accumulate weights of sources in a dense array, recording which sources are touched.
+    std::vector<double> accumulated( _numSources, 0.0 );
+    std::vector<char> touched( _numSources, 0 );
+    IndexList sources;
+    unsigned int numStencils = lhs.getNumStencils();
+    for ( unsigned int i=0; i<numStencils; ++i )
+    {
+        sources.clear();
+        for ( unsigned int j=lhs._offsets[i]; j<lhs._offsets[i+1]; ++j )
+        {
+            unsigned int row = lhs._indices[j];
+            double weight = lhs._weights[j];
+            for ( unsigned int k=rhs._offsets[row]; k<rhs._offsets[row+1]; ++k )
+            {
+                unsigned int index = rhs._indices[k];
+                if ( !touched[index] )
+                {
+                    touched[index] = 1;
+                    sources.push_back( index );
+                }
+                accumulated[index] += weight * rhs._weights[k];
+            }
+        }
+
+        // Sorted indices make reading sources more cache friendly.
+        std::sort( sources.begin(), sources.end() );
+        for ( IndexList::iterator itr=sources.begin(); itr!=sources.end(); ++itr )
+        {
+            if ( accumulated[*itr]!=0.0 ) addWeight( *itr, accumulated[*itr] );
+            accumulated[*itr] = 0.0;
+            touched[*itr] = 0;
+        }
+        finishStencil();
+    }
+}
+
+void StencilTable::apply( const osg::Vec3Array* sources, osg::Vec3Array* results, TaskPool* pool, unsigned int grainSize ) const
+{
+    if ( !sources || !results ) return;
+    if ( sources->size()<_numSources )
+    {
+        osg::notify(osg::WARN) << "osgModeling: Not enough source points for the stencil table." << std::endl;
+        return;
+    }
+
+    unsigned int numStencils = getNumStencils();
+    results->resize( numStencils );
+    TaskPool::parallelFor( ApplyStencilsPass(*this, *sources, *results), numStencils, pool, grainSize );
+}
+
+SubdivisionStencils::SubdivisionStencils():
+    osg::Referenced(),
+    _level(0)
+{
+    _vertexStencils = new StencilTable;
+    _limitStencils = new StencilTable;
+    _tangentStencils[0] = new StencilTable;
+    _tangentStencils[1] = new StencilTable;
+}
+
+void SubdivisionStencils::computePositions( const osg::Vec3Array* controls, osg::Vec3Array* results, bool limit,
+                                            TaskPool* pool, unsigned int grainSize ) const
+{
+    if ( limit && _limitStencils->getNumStencils() ) _limitStencils->apply( controls, results, pool, grainSize );
+    else _vertexStencils->apply( controls, results, pool, grainSize );
+}
+
+void SubdivisionStencils::computeNormals( const osg::Vec3Array* controls, osg::Vec3Array* results,
+                                          TaskPool* pool, unsigned int grainSize )
+{
+    if ( !results ) return;
+    if ( !_scratch ) _scratch = new osg::Vec3Array;
+
+    if ( !_tangentStencils[0]->getNumStencils() )
+    {
+        _vertexStencils->apply( controls, _scratch.get(), pool, grainSize );
+        computeFaceNormals( _scratch.get(), results );
+        return;
+    }
+
+    osg::Vec3Array* tangent = _scratch.get();
+    _tangentStencils[0]->apply( controls, results, pool, grainSize );
+    _tangentStencils[1]->apply( controls, tangent, pool, grainSize );
+    if ( tangent->size()!=results->size() ) return;
+
+    for ( unsigned int i=0; i<results->size(); ++i )
+    {
+        osg::Vec3& normal = (*results)[i];
+        normal = normal ^ (*tangent)[i];
+        normal.normalize();
+    }
+}
+
+void SubdivisionStencils::computeFaceNormals( const osg::Vec3Array* vertices, osg::Vec3Array* results ) const
+{
+    if ( !vertices || !results ) return;
+
+    results->assign( vertices->size(), osg::Vec3() );
+    for ( unsigned int i=0; i+2<_faceIndices.size(); i+=3 )
+    {
+        unsigned int i0=_faceIndices[i], i1=_faceIndices[i+1], i2=_faceIndices[i+2];
+        if ( i0>=vertices->size() || i1>=vertices->size() || i2>=vertices->size() ) continue;
+
+        osg::Vec3 normal = ((*vertices)[i1]-(*vertices)[i0]) ^ ((*vertices)[i2]-(*vertices)[i0]);
+        (*results)[i0] += normal;
+        (*results)[i1] += normal;
+        (*results)[i2] += normal;
+    }
+    for ( unsigned int i=0; i<results->size(); ++i ) (*results)[i].normalize();
+}
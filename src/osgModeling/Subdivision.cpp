@@ -15,6 +15,7 @@
 * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#include <algorithm>
 #include <osgModeling/Utilities>
 #include <osgModeling/Subdivision>
 
@@ -42,126 +43,958 @@ LoopSubdivision::~LoopSubdivision()
 {
 }
 
+/** Get weights of a vertex and each of its neighbors by the Loop vertex rule. */
+static void getLoopVertexWeights( unsigned int size, double& self, double& neighbor )
+{
+    if ( size>2 )
+    {
+        double beta = (size==3)?0.1875f:(0.375f/size);
+        self = 1-size*beta;
+        neighbor = beta;
+    }
+    else if ( size==2 )
+    {
+        self = 0.75;
+        neighbor = 0.125;
+    }
+    else
+    {
+        self = 1.0;
+        neighbor = 0.0;
+    }
+}
+
+/** Pass moving vertices of a triangle mesh by the Loop vertex stencil. */
+struct LoopVertexPass
+{
+    const HalfEdgeMesh& _mesh;
+    osg::Vec3Array& _points;
+    const VECTOR<char>* _moved;
+
+    LoopVertexPass( const HalfEdgeMesh& mesh, osg::Vec3Array& points, const VECTOR<char>* moved=NULL ):
+        _mesh(mesh), _points(points), _moved(moved) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        HalfEdgeMesh::IndexList neighbors;
+        for ( unsigned int v=begin; v<end; ++v )
+        {
+            if ( _moved && !(*_moved)[v] )
+            {
+                _points[v] = _mesh.getPosition( v );
+                continue;
+            }
+
+            neighbors.clear();
+            _mesh.findNeighbors( v, neighbors );
+
+            osg::Vec3 vec = _mesh.getPosition( v );
+            unsigned int size = neighbors.size();
+            osg::Vec3 summaryVec( 0.0f, 0.0f, 0.0f );
+            for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+                summaryVec += _mesh.getPosition( *itr );
+
+            double self, neighbor;
+            getLoopVertexWeights( size, self, neighbor );
+            _points[v] = vec*self + summaryVec*neighbor;
+        }
+    }
+};
+
+/** Pass creating Loop edge points, which are stored after all vertices.
+ * If a list of edge point indices is specified, only edges having valid indices are split.
+ */
+struct LoopEdgePass
+{
+    const HalfEdgeMesh& _mesh;
+    osg::Vec3Array& _points;
+    const HalfEdgeMesh::IndexList* _edgePoints;
+
+    LoopEdgePass( const HalfEdgeMesh& mesh, osg::Vec3Array& points, const HalfEdgeMesh::IndexList* edgePoints=NULL ):
+        _mesh(mesh), _points(points), _edgePoints(edgePoints) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        unsigned int numVertices = _mesh.getNumVertices();
+        for ( unsigned int e=begin; e<end; ++e )
+        {
+            unsigned int index = _edgePoints ? (*_edgePoints)[e] : numVertices+e;
+            if ( index==HalfEdgeMesh::INVALID_INDEX ) continue;
+
+            unsigned int h = _mesh.getEdgeHalfEdge( e ), twin = _mesh.getTwin( h );
+            osg::Vec3 ev0=_mesh.getPosition(_mesh.getOrigin(h)), ev1=_mesh.getPosition(_mesh.getTarget(h));
+            if ( twin==HalfEdgeMesh::INVALID_INDEX )
+            {
+                // Boundary edges
+                _points[index] = (ev0+ev1) * 0.5f;
+            }
+            else
+            {
+                // Interior edges
+                osg::Vec3 v1=_mesh.getPosition(_mesh.getOrigin(_mesh.getPrev(h))),
+                    v2=_mesh.getPosition(_mesh.getOrigin(_mesh.getPrev(twin)));
+                _points[index] = (ev0+ev1)*0.375f + (v1+v2)*0.125f;
+            }
+        }
+    }
+};
+
+/** Pass creating 4 new triangles of each face, stored at 4 times the face index. */
+struct LoopFacePass
+{
+    const HalfEdgeMesh& _mesh;
+    osg::Vec3Array* _vertices;
+    PolyMesh::FaceList& _faces;
+
+    LoopFacePass( const HalfEdgeMesh& mesh, osg::Vec3Array* vertices, PolyMesh::FaceList& faces ):
+        _mesh(mesh), _vertices(vertices), _faces(faces) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        unsigned int numVertices = _mesh.getNumVertices();
+        for ( unsigned int f=begin; f<end; ++f )
+        {
+            unsigned int h = _mesh.getFaceHalfEdge( f );
+            int v[3], ev[3];
+            for ( unsigned int i=0; i<3; ++i )
+            {
+                v[i] = _mesh.getOrigin( h+i );
+                ev[i] = numVertices + _mesh.getEdgeIndex( h+i );
+            }
+            _faces[4*f] = new PolyMesh::Face( _vertices, v[0], ev[0], ev[2] );
+            _faces[4*f+1] = new PolyMesh::Face( _vertices, v[1], ev[1], ev[0] );
+            _faces[4*f+2] = new PolyMesh::Face( _vertices, v[2], ev[2], ev[1] );
+            _faces[4*f+3] = new PolyMesh::Face( _vertices, ev[0], ev[1], ev[2] );
+        }
+    }
+};
+
+/** Pass creating faces of adaptive Loop subdivision, stored from offsets of each face.
+ * Refined faces are split into 4, faces with one split edge into 2, and other faces are copied.
+ */
+struct LoopAdaptiveFacePass
+{
+    const HalfEdgeMesh& _mesh;
+    const VECTOR<char>& _refined;
+    const HalfEdgeMesh::IndexList& _edgePoints;
+    const HalfEdgeMesh::IndexList& _offsets;
+    osg::Vec3Array* _vertices;
+    PolyMesh::FaceList& _faces;
+
+    LoopAdaptiveFacePass( const HalfEdgeMesh& mesh, const VECTOR<char>& refined, const HalfEdgeMesh::IndexList& edgePoints,
+                          const HalfEdgeMesh::IndexList& offsets, osg::Vec3Array* vertices, PolyMesh::FaceList& faces ):
+        _mesh(mesh), _refined(refined), _edgePoints(edgePoints), _offsets(offsets), _vertices(vertices), _faces(faces) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        for ( unsigned int f=begin; f<end; ++f )
+        {
+            unsigned int h = _mesh.getFaceHalfEdge( f ), offset = _offsets[f];
+            int v[3], ev[3], split=-1;
+            for ( unsigned int i=0; i<3; ++i )
+            {
+                v[i] = _mesh.getOrigin( h+i );
+                ev[i] = _edgePoints[_mesh.getEdgeIndex(h+i)];
+                if ( ev[i]!=(int)HalfEdgeMesh::INVALID_INDEX ) split = i;
+            }
+
+            if ( _refined[f] )
+            {
+                _faces[offset] = new PolyMesh::Face( _vertices, v[0], ev[0], ev[2] );
+                _faces[offset+1] = new PolyMesh::Face( _vertices, v[1], ev[1], ev[0] );
+                _faces[offset+2] = new PolyMesh::Face( _vertices, v[2], ev[2], ev[1] );
+                _faces[offset+3] = new PolyMesh::Face( _vertices, ev[0], ev[1], ev[2] );
+            }
+            else if ( split>=0 )
+            {
+                // Bisect the face from the split edge to the opposite vertex
+                int v0=v[split], v1=v[(split+1)%3], v2=v[(split+2)%3];
+                _faces[offset] = new PolyMesh::Face( _vertices, v0, ev[split], v2 );
+                _faces[offset+1] = new PolyMesh::Face( _vertices, ev[split], v1, v2 );
+            }
+            else
+                _faces[offset] = new PolyMesh::Face( _vertices, v[0], v[1], v[2] );
+        }
+    }
+};
+
+/** Get the half-edge mesh of a triangle mesh, creating a temporary one if the mesh uses the edge map.
+ * Returns NULL if the mesh can't be subdivided.
+ */
+static HalfEdgeMesh* obtainTriangleHalfEdges( PolyMesh* mesh )
+{
+    osg::ref_ptr<HalfEdgeMesh> hem = mesh->getHalfEdgeMesh();
+    if ( !hem.valid() ) hem = mesh->createHalfEdgeMesh();
+    if ( !hem.valid() || !hem->getNumFaces() || hem->getNumJunctionHalfEdges() ) return NULL;
+
+    for ( unsigned int f=0; f<hem->getNumFaces(); ++f )
+    {
+        if ( hem->getFaceSize(f)!=3 ) return NULL;
+    }
+    return hem.release();
+}
+
+float CurvatureCriterion::operator()( const HalfEdgeMesh& mesh, unsigned int f ) const
+{
+    unsigned int h = mesh.getFaceHalfEdge( f );
+    const osg::Vec3& p0 = mesh.getPosition( mesh.getOrigin(h) );
+    osg::Vec3 normal = (mesh.getPosition(mesh.getOrigin(h+1))-p0) ^ (mesh.getPosition(mesh.getOrigin(h+2))-p0);
+    if ( normal.normalize()==0.0f ) return 0.0f;
+
+    float maxAngle = 0.0f;
+    for ( unsigned int i=0; i<3; ++i )
+    {
+        unsigned int twin = mesh.getTwin( h+i );
+        if ( twin==HalfEdgeMesh::INVALID_INDEX ) continue;
+
+        unsigned int t = mesh.getFaceHalfEdge( mesh.getFace(twin) );
+        const osg::Vec3& q0 = mesh.getPosition( mesh.getOrigin(t) );
+        osg::Vec3 neighborNormal = (mesh.getPosition(mesh.getOrigin(t+1))-q0) ^ (mesh.getPosition(mesh.getOrigin(t+2))-q0);
+        if ( neighborNormal.normalize()==0.0f ) continue;
+
+        float angle = acos( osg::clampTo(normal*neighborNormal, -1.0f, 1.0f) );
+        if ( angle>maxAngle ) maxAngle = angle;
+    }
+    return maxAngle>_angle ? maxAngle : 0.0f;
+}
+
+float ScreenSizeCriterion::operator()( const HalfEdgeMesh& mesh, unsigned int f ) const
+{
+    unsigned int h = mesh.getFaceHalfEdge( f );
+    osg::Vec2 window[3];
+    for ( unsigned int i=0; i<3; ++i )
+    {
+        osg::Vec4 clip = osg::Vec4(mesh.getPosition(mesh.getOrigin(h+i)), 1.0f) * _matrix;
+        if ( clip.w()<=0.0f ) return 0.0f;
+        window[i].set( clip.x()/clip.w(), clip.y()/clip.w() );
+    }
+
+    float maxLength = 0.0f;
+    for ( unsigned int i=0; i<3; ++i )
+    {
+        float length = (window[(i+1)%3]-window[i]).length();
+        if ( length>maxLength ) maxLength = length;
+    }
+    return maxLength>_pixels ? maxLength : 0.0f;
+}
+
+/** Pass computing refining priorities of faces. */
+struct CriterionPass
+{
+    const SubdivisionCriterion& _criterion;
+    const HalfEdgeMesh& _mesh;
+    VECTOR<float>& _priorities;
+
+    CriterionPass( const SubdivisionCriterion& criterion, const HalfEdgeMesh& mesh, VECTOR<float>& priorities ):
+        _criterion(criterion), _mesh(mesh), _priorities(priorities) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        for ( unsigned int f=begin; f<end; ++f )
+            _priorities[f] = _criterion( _mesh, f );
+    }
+};
+
+struct PriorityLess
+{
+    const VECTOR<float>& _priorities;
+    PriorityLess( const VECTOR<float>& priorities ): _priorities(priorities) {}
+
+    bool operator()( unsigned int lhs, unsigned int rhs ) const
+    {
+        if ( _priorities[lhs]!=_priorities[rhs] ) return _priorities[lhs]>_priorities[rhs];
+        return lhs<rhs;
+    }
+};
+
+void Subdivision::selectFaces( const HalfEdgeMesh& mesh, HalfEdgeMesh::IndexList& faces )
+{
+    faces.clear();
+    if ( !_criterion.valid() ) return;
+
+    unsigned int numFaces = mesh.getNumFaces();
+    VECTOR<float> priorities( numFaces );
+    TaskPool::parallelFor( CriterionPass(*_criterion, mesh, priorities), numFaces, _parallel ? getTaskPool() : NULL, _parallelGrainSize );
+
+    for ( unsigned int f=0; f<numFaces; ++f )
+    {
+        if ( priorities[f]>0.0f ) faces.push_back( f );
+    }
+    std::sort( faces.begin(), faces.end(), PriorityLess(priorities) );
+}
+
+SubdivisionStencils* Subdivision::createLevelStencils( PolyMesh* mesh, RefineFunction refine, osg::ref_ptr<HalfEdgeMesh>& levelMesh )
+{
+    if ( !mesh || !mesh->_faces.size() ) return NULL;
+
+    osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( mesh->getVertexArray() );
+    if ( !vertices || !vertices->size() ) return NULL;
+
+    levelMesh = obtainTriangleHalfEdges( mesh );
+    if ( !levelMesh.valid() )
+    {
+        osg::notify(osg::WARN) << "osgModeling: Can't create stencils of a non-triangle or non-manifold mesh." << std::endl;
+        return NULL;
+    }
+
+    // Vertices of the mesh refer to the first source vertex at the same position.
+    osg::ref_ptr<StencilTable> vertexStencils = new StencilTable( vertices->size() );
+    for ( unsigned int v=0; v<levelMesh->getNumVertices(); ++v )
+    {
+        vertexStencils->addWeight( levelMesh->getSourceIndex(v), 1.0f );
+        vertexStencils->finishStencil();
+    }
+
+    HalfEdgeMesh::IndexList faceIndices;
+    for ( unsigned int f=0; f<levelMesh->getNumFaces(); ++f )
+    {
+        unsigned int h = levelMesh->getFaceHalfEdge( f );
+        for ( unsigned int i=0; i<3; ++i ) faceIndices.push_back( levelMesh->getOrigin(h+i) );
+    }
+
+    // Refine the topology level by level, and compose stencils of each level with previous ones.
+    osg::ref_ptr<StencilTable> levelStencils = new StencilTable;
+    HalfEdgeMesh::IndexList faceSizes;
+    for ( int level=0; level<_level; ++level )
+    {
+        refine( *levelMesh, *levelStencils, faceIndices );
+        osg::ref_ptr<StencilTable> composed = new StencilTable;
+        composed->multiply( *levelStencils, *vertexStencils );
+        vertexStencils = composed;
+
+        faceSizes.assign( faceIndices.size()/3, 3 );
+        levelMesh = new HalfEdgeMesh;
+        levelMesh->build( levelStencils->getNumStencils(), faceSizes, faceIndices );
+    }
+
+    osg::ref_ptr<SubdivisionStencils> stencils = new SubdivisionStencils;
+    stencils->setLevel( _level );
+    stencils->setVertexStencils( vertexStencils.get() );
+    stencils->getFaceIndices().swap( faceIndices );
+    return stencils.release();
+}
+
+bool Subdivision::subdivideInto( PolyMesh* control, osg::Geometry* result )
+{
+    if ( !control || !result ) return false;
+
+    osg::Vec3Array* controls = dynamic_cast<osg::Vec3Array*>( control->getVertexArray() );
+    if ( !controls ) return false;
+
+    // The connectivity is recorded as size and vertex indices of each face.
+    HalfEdgeMesh::IndexList connectivity;
+    connectivity.reserve( _cachedConnectivity.size() );
+    for ( PolyMesh::FaceList::iterator itr=control->_faces.begin(); itr!=control->_faces.end(); ++itr )
+    {
+        PolyMesh::Face* f = *itr;
+        unsigned int size = f->_pts.size();
+        connectivity.push_back( size );
+        for ( unsigned int i=0; i<size; ++i ) connectivity.push_back( (*f)(i) );
+    }
+
+    bool rebuilt = false;
+    if ( !_cachedStencils.valid() || _cachedStencils->getLevel()!=(unsigned int)_level ||
+         _cachedStencils->getVertexStencils()->getNumSources()!=controls->size() ||
+         connectivity.size()!=_cachedConnectivity.size() ||
+         !std::equal(connectivity.begin(), connectivity.end(), _cachedConnectivity.begin()) )
+    {
+        _cachedConnectivity.clear();
+        _cachedStencils = createStencils( control );
+        if ( !_cachedStencils.valid() ) return false;
+
+        _cachedConnectivity.swap( connectivity );
+        rebuilt = true;
+    }
+
+    osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( result->getVertexArray() );
+    if ( !vertices )
+    {
+        vertices = new osg::Vec3Array;
+        result->setVertexArray( vertices );
+    }
+
+    osg::Vec3Array* normals = dynamic_cast<osg::Vec3Array*>( result->getNormalArray() );
+    if ( !normals )
+    {
+        normals = new osg::Vec3Array;
+        result->setNormalArray( normals );
+    }
+    result->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+
+    TaskPool* pool = _parallel ? getTaskPool() : NULL;
+    _cachedStencils->computePositions( controls, vertices, false, pool, _parallelGrainSize );
+    _cachedStencils->computeFaceNormals( vertices, normals );
+    vertices->dirty();
+    normals->dirty();
+
+    if ( rebuilt )
+    {
+        const HalfEdgeMesh::IndexList& indices = _cachedStencils->getFaceIndices();
+        result->removePrimitiveSet( 0, result->getPrimitiveSetList().size() );
+        result->addPrimitiveSet( new osg::DrawElementsUInt(osg::PrimitiveSet::TRIANGLES, indices.size(), &indices.front()) );
+    }
+    result->dirtyDisplayList();
+    result->dirtyBound();
+    return true;
+}
+
 void LoopSubdivision::subdivide( PolyMesh* mesh )
 {
     if ( !mesh || !mesh->_faces.size() ) return;
 
-    PolyMesh::MeshType type = mesh->getType();
-    if ( type==PolyMesh::INVALID_MESH || type==PolyMesh::NONMANIFOLD_MESH )
-        return;
-
     osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( mesh->getVertexArray() );
     if ( !vertices || !vertices->size() ) return;
-    unsigned int ptNum = vertices->size();
 
-    // Reset current vertices to build subdivision points.
-    // Here we use a reference array and put modified vertices in it first.
-    // The modified vertices will be used for point-edge map (PolyMesh::EdgeMap) generating,
-    // BUT original ones should be used for edge splitting.
-    osg::ref_ptr<osg::Vec3Array> refVertices = new osg::Vec3Array( vertices->begin(), vertices->end() );
-    subdivideVertices( mesh, refVertices.get(), ptNum );
+    osg::ref_ptr<HalfEdgeMesh> hem = obtainTriangleHalfEdges( mesh );
+    if ( !hem.valid() ) return;
+
+    if ( _criterion.valid() )
+    {
+        subdivideAdaptive( mesh, *hem );
+        return;
+    }
+    else if ( _maxFaces && hem->getNumFaces()*4>_maxFaces )
+        return;
 
-    // Split edges to build subdivision points.
-    // New allocated edge points will be inserted into the 'vertices' array, and 'refVertices'
-    // is used for point-edge map generating.
-    subdivideFace( mesh, mesh->_faces.front(), refVertices.get(), vertices );
+    // Moved vertices are followed by edge points in the new vertex array.
+    // Both are computed from original positions kept in the half-edge mesh.
+    TaskPool* pool = _parallel ? getTaskPool() : NULL;
+    unsigned int numVertices = hem->getNumVertices(), numFaces = hem->getNumFaces();
+    osg::ref_ptr<osg::Vec3Array> points = new osg::Vec3Array( numVertices+hem->getNumEdges() );
+    TaskPool::parallelFor( LoopVertexPass(*hem, *points), numVertices, pool, _parallelGrainSize );
+    TaskPool::parallelFor( LoopEdgePass(*hem, *points), hem->getNumEdges(), pool, _parallelGrainSize );
 
-    // Merge 'refVertices' points, which were modified just now, into 'vertices'
-    vertices->erase( vertices->begin(), vertices->begin()+ptNum );
-    vertices->insert( vertices->begin(), refVertices->begin(), refVertices->end() );
+    PolyMesh::FaceList newFaces( numFaces*4 );
+    TaskPool::parallelFor( LoopFacePass(*hem, vertices, newFaces), numFaces, pool, _parallelGrainSize );
 
+    vertices->clear();
+    vertices->insert( vertices->end(), points->begin(), points->end() );
     mesh->destroyMesh();
-    mesh->_edges.swap( _tempEdges );
-    mesh->_faces.swap( _tempFaces );
-    _edgeVertices.clear();
-    _tempEdges.clear();
-    _tempFaces.clear();
+    mesh->_faces.swap( newFaces );
+    mesh->rebuildTopology();
 }
 
-void LoopSubdivision::subdivideVertices( PolyMesh* mesh, osg::Vec3Array* pts, unsigned int ptNum )
+/** Get weights of a vertex and each of its neighbors by the Sqrt(3) vertex rule. */
+static void getSqrt3VertexWeights( unsigned int size, double& self, double& neighbor )
 {
-    for ( unsigned int i=0; i<ptNum; ++i )
+    if ( size )
+    {
+        double beta = (4-2*cos(2*osg::PI/size)) / (9*size);
+        self = 1-size*beta;
+        neighbor = beta;
+    }
+    else
     {
-        PolyMesh::VertexList vlist;
-        osg::Vec3 vec = (*pts)[i];
-        mesh->findNeighbors( vec, vlist );
+        self = 1.0;
+        neighbor = 0.0;
+    }
+}
+
+/** Pass moving vertices of a triangle mesh by the Sqrt(3) vertex stencil. */
+struct Sqrt3VertexPass
+{
+    const HalfEdgeMesh& _mesh;
+    osg::Vec3Array& _points;
+    const VECTOR<char>* _moved;
+
+    Sqrt3VertexPass( const HalfEdgeMesh& mesh, osg::Vec3Array& points, const VECTOR<char>* moved=NULL ):
+        _mesh(mesh), _points(points), _moved(moved) {}
 
-        unsigned int size = vlist.size();
-        if ( size>2 )
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        HalfEdgeMesh::IndexList neighbors;
+        for ( unsigned int v=begin; v<end; ++v )
         {
+            if ( _moved && !(*_moved)[v] )
+            {
+                _points[v] = _mesh.getPosition( v );
+                continue;
+            }
+
+            neighbors.clear();
+            _mesh.findNeighbors( v, neighbors );
+
+            osg::Vec3 vec = _mesh.getPosition( v );
+            unsigned int size = neighbors.size();
+            _points[v] = vec;
+            if ( !size ) continue;
+
             osg::Vec3 summaryVec( 0.0f, 0.0f, 0.0f );
-            for ( PolyMesh::VertexList::iterator itr=vlist.begin(); itr!=vlist.end(); ++itr )
-                summaryVec += *itr;
+            for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+                summaryVec += _mesh.getPosition( *itr );
 
-            double beta = (size==3)?0.1875f:(0.375f/size);
-            (*pts)[i] = vec*(1-size*beta) + summaryVec*beta;
+            double self, neighbor;
+            getSqrt3VertexWeights( size, self, neighbor );
+            _points[v] = vec*self + summaryVec*neighbor;
         }
-        else if ( size==2 )
+    }
+};
+
+/** Pass creating face centers, which are stored after all vertices.
+ * If a list of center indices is specified, only faces having valid indices get centers.
+ */
+struct Sqrt3CenterPass
+{
+    const HalfEdgeMesh& _mesh;
+    osg::Vec3Array& _points;
+    const HalfEdgeMesh::IndexList* _centers;
+
+    Sqrt3CenterPass( const HalfEdgeMesh& mesh, osg::Vec3Array& points, const HalfEdgeMesh::IndexList* centers=NULL ):
+        _mesh(mesh), _points(points), _centers(centers) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        unsigned int numVertices = _mesh.getNumVertices();
+        for ( unsigned int f=begin; f<end; ++f )
         {
-            (*pts)[i] = vec*0.75f + (vlist[0]+vlist[1])*0.125f;
+            unsigned int index = _centers ? (*_centers)[f] : numVertices+f;
+            if ( index==HalfEdgeMesh::INVALID_INDEX ) continue;
+
+            unsigned int h = _mesh.getFaceHalfEdge( f );
+            _points[index] = (_mesh.getPosition(_mesh.getOrigin(h)) + _mesh.getPosition(_mesh.getOrigin(h+1)) +
+                _mesh.getPosition(_mesh.getOrigin(h+2))) / 3.0f;
         }
     }
-}
+};
 
-void LoopSubdivision::subdivideFace( PolyMesh* mesh, PolyMesh::Face* f, osg::Vec3Array* refPts, osg::Vec3Array* pts )
+/** Pass flipping original edges, writing new faces of each edge from its offset. */
+struct Sqrt3FlipPass
 {
-    if ( !f || f->_flag ) return;
+    const HalfEdgeMesh& _mesh;
+    const HalfEdgeMesh::IndexList& _offsets;
+    osg::Vec3Array* _vertices;
+    PolyMesh::FaceList& _faces;
 
-    int evIndex[3] = {0}; // Only for triangles
-    osg::Vec3 edgeVertex[3];
-    PolyMesh::EdgeList edges;
-    PolyMesh::EdgeList::iterator itr;
-    mesh->findEdgeList( f, edges );
+    Sqrt3FlipPass( const HalfEdgeMesh& mesh, const HalfEdgeMesh::IndexList& offsets, osg::Vec3Array* vertices,
+                   PolyMesh::FaceList& faces ): _mesh(mesh), _offsets(offsets), _vertices(vertices), _faces(faces) {}
 
-    int i=0;
-    for ( itr=edges.begin(); itr!=edges.end() && i<3; ++i, ++itr )
+    void operator()( unsigned int begin, unsigned int end ) const
     {
-        PolyMesh::Edge* edge = *itr;
-        if ( _edgeVertices.find(edge)!=_edgeVertices.end() )
+        unsigned int numVertices = _mesh.getNumVertices();
+        for ( unsigned int e=begin; e<end; ++e )
         {
-            evIndex[i] = _edgeVertices[edge];
-            edgeVertex[i] = pts->at( evIndex[i] );
+            unsigned int h = _mesh.getEdgeHalfEdge( e ), twin = _mesh.getTwin( h );
+            int v0=_mesh.getOrigin(h), v1=_mesh.getTarget(h), center=numVertices+_mesh.getFace(h);
+            if ( twin==HalfEdgeMesh::INVALID_INDEX )
+                _faces[_offsets[e]] = new PolyMesh::Face( _vertices, v0, v1, center );
+            else
+            {
+                int twinCenter = numVertices+_mesh.getFace(twin);
+                _faces[_offsets[e]] = new PolyMesh::Face( _vertices, twinCenter, v1, center );
+                _faces[_offsets[e]+1] = new PolyMesh::Face( _vertices, center, v0, twinCenter );
+            }
         }
-        else
+    }
+};
+
+void LoopSubdivision::subdivideAdaptive( PolyMesh* mesh, const HalfEdgeMesh& hem )
+{
+    HalfEdgeMesh::IndexList candidates;
+    selectFaces( hem, candidates );
+    if ( !candidates.size() ) return;
+
+    // Mark faces to refine and their edges to split. A face having 2 or more split edges is refined too,
+    // so other faces have at most one split edge and can be bisected.
+    unsigned int numVertices = hem.getNumVertices(), numFaces = hem.getNumFaces(), numEdges = hem.getNumEdges();
+    VECTOR<char> refined( numFaces, 0 ), splitEdges( numEdges, 0 );
+    HalfEdgeMesh::IndexList numSplits( numFaces, 0 ), stack, faceLog, edgeLog;
+    unsigned int faceCount = numFaces;
+    for ( HalfEdgeMesh::IndexList::iterator itr=candidates.begin(); itr!=candidates.end(); ++itr )
+    {
+        if ( refined[*itr] ) continue;
+
+        unsigned int lastCount = faceCount;
+        faceLog.clear();
+        edgeLog.clear();
+        stack.push_back( *itr );
+        while ( stack.size() )
         {
-            osg::Vec3 ev0=(*edge)[0], ev1=(*edge)[1];
-            PolyMesh::FaceList fl = edge->_faces;
-            if ( fl.size()<2 )
+            unsigned int f = stack.back();
+            stack.pop_back();
+            if ( refined[f] ) continue;
+
+            // The face was split into 1+numSplits pieces and now into 4
+            refined[f] = 1;
+            faceLog.push_back( f );
+            faceCount += 3-numSplits[f];
+
+            unsigned int h = hem.getFaceHalfEdge( f );
+            for ( unsigned int i=0; i<3; ++i )
             {
-                // Boundary edges
-                edgeVertex[i] = (ev0+ev1) * 0.5f;
+                unsigned int e = hem.getEdgeIndex( h+i ), twin = hem.getTwin( h+i );
+                if ( splitEdges[e] ) continue;
+
+                splitEdges[e] = 1;
+                edgeLog.push_back( e );
+                numSplits[f]++;
+                if ( twin==HalfEdgeMesh::INVALID_INDEX ) continue;
+
+                unsigned int g = hem.getFace( twin );
+                numSplits[g]++;
+                if ( !refined[g] )
+                {
+                    faceCount++;
+                    if ( numSplits[g]>1 ) stack.push_back( g );
+                }
             }
-            else
+        }
+
+        if ( _maxFaces && faceCount>_maxFaces )
+        {
+            // Undo the last refinement which exceeds the budget
+            for ( HalfEdgeMesh::IndexList::iterator fitr=faceLog.begin(); fitr!=faceLog.end(); ++fitr )
+                refined[*fitr] = 0;
+            for ( HalfEdgeMesh::IndexList::iterator eitr=edgeLog.begin(); eitr!=edgeLog.end(); ++eitr )
             {
-                // Interior edges
-                osg::Vec3 v1=*(fl[0])-(*edge), v2=*(fl[1])-(*edge);
-                edgeVertex[i] = (ev0+ev1)*0.375f + (v1+v2)*0.125f;
+                unsigned int h = hem.getEdgeHalfEdge( *eitr ), twin = hem.getTwin( h );
+                splitEdges[*eitr] = 0;
+                numSplits[hem.getFace(h)]--;
+                if ( twin!=HalfEdgeMesh::INVALID_INDEX ) numSplits[hem.getFace(twin)]--;
             }
+            faceCount = lastCount;
+            break;
+        }
+    }
+    if ( faceCount==numFaces ) return;
+
+    // Only end points of split edges are moved, so unrefined regions keep their shape.
+    HalfEdgeMesh::IndexList edgePoints( numEdges, HalfEdgeMesh::INVALID_INDEX );
+    VECTOR<char> moved( numVertices, 0 );
+    unsigned int numPoints = numVertices;
+    for ( unsigned int e=0; e<numEdges; ++e )
+    {
+        if ( !splitEdges[e] ) continue;
+
+        unsigned int h = hem.getEdgeHalfEdge( e );
+        edgePoints[e] = numPoints++;
+        moved[hem.getOrigin(h)] = 1;
+        moved[hem.getTarget(h)] = 1;
+    }
+
+    HalfEdgeMesh::IndexList faceOffsets( numFaces+1, 0 );
+    for ( unsigned int f=0; f<numFaces; ++f )
+        faceOffsets[f+1] = faceOffsets[f] + (refined[f] ? 4 : 1+numSplits[f]);
+
+    TaskPool* pool = _parallel ? getTaskPool() : NULL;
+    osg::ref_ptr<osg::Vec3Array> points = new osg::Vec3Array( numPoints );
+    TaskPool::parallelFor( LoopVertexPass(hem, *points, &moved), numVertices, pool, _parallelGrainSize );
+    TaskPool::parallelFor( LoopEdgePass(hem, *points, &edgePoints), numEdges, pool, _parallelGrainSize );
+
+    osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( mesh->getVertexArray() );
+    PolyMesh::FaceList newFaces( faceOffsets.back() );
+    TaskPool::parallelFor( LoopAdaptiveFacePass(hem, refined, edgePoints, faceOffsets, vertices, newFaces), numFaces, pool, _parallelGrainSize );
+
+    vertices->clear();
+    vertices->insert( vertices->end(), points->begin(), points->end() );
+    mesh->destroyMesh();
+    mesh->_faces.swap( newFaces );
+    mesh->rebuildTopology();
+}
+
+/** Pass creating faces of adaptive Sqrt(3) subdivision around each edge, stored from offsets of each edge.
+ * Edges between 2 refined faces are flipped. Other edges form one face with the center of the refined side.
+ */
+struct Sqrt3AdaptiveFlipPass
+{
+    const HalfEdgeMesh& _mesh;
+    const HalfEdgeMesh::IndexList& _centers;
+    const HalfEdgeMesh::IndexList& _offsets;
+    osg::Vec3Array* _vertices;
+    PolyMesh::FaceList& _faces;
+
+    Sqrt3AdaptiveFlipPass( const HalfEdgeMesh& mesh, const HalfEdgeMesh::IndexList& centers, const HalfEdgeMesh::IndexList& offsets,
+                           osg::Vec3Array* vertices, PolyMesh::FaceList& faces ):
+        _mesh(mesh), _centers(centers), _offsets(offsets), _vertices(vertices), _faces(faces) {}
+
+    void operator()( unsigned int begin, unsigned int end ) const
+    {
+        for ( unsigned int e=begin; e<end; ++e )
+        {
+            unsigned int h = _mesh.getEdgeHalfEdge( e ), twin = _mesh.getTwin( h );
+            int v0=_mesh.getOrigin(h), v1=_mesh.getTarget(h), center=_centers[_mesh.getFace(h)];
+            int twinCenter = twin==HalfEdgeMesh::INVALID_INDEX ? -1 : (int)_centers[_mesh.getFace(twin)];
+            bool refined = center!=(int)HalfEdgeMesh::INVALID_INDEX;
+            bool twinRefined = twinCenter>=0 && twinCenter!=(int)HalfEdgeMesh::INVALID_INDEX;
+            if ( refined && twinRefined )
+            {
+                _faces[_offsets[e]] = new PolyMesh::Face( _vertices, twinCenter, v1, center );
+                _faces[_offsets[e]+1] = new PolyMesh::Face( _vertices, center, v0, twinCenter );
+            }
+            else if ( refined )
+                _faces[_offsets[e]] = new PolyMesh::Face( _vertices, v0, v1, center );
+            else if ( twinRefined )
+                _faces[_offsets[e]] = new PolyMesh::Face( _vertices, v1, v0, twinCenter );
+        }
+    }
+};
+
+/** Create stencils of vertices of the next level from the Loop vertex and edge rules, and faces of that level. */
+static void createLoopRefineStencils( const HalfEdgeMesh& mesh, StencilTable& table, HalfEdgeMesh::IndexList& faceIndices )
+{
+    unsigned int numVertices = mesh.getNumVertices(), numEdges = mesh.getNumEdges();
+    table.clear( numVertices );
+
+    HalfEdgeMesh::IndexList neighbors;
+    for ( unsigned int v=0; v<numVertices; ++v )
+    {
+        neighbors.clear();
+        mesh.findNeighbors( v, neighbors );
+
+        double self, neighbor;
+        getLoopVertexWeights( neighbors.size(), self, neighbor );
+        table.addWeight( v, self );
+        if ( neighbor!=0.0 )
+        {
+            for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+                table.addWeight( *itr, neighbor );
+        }
+        table.finishStencil();
+    }
+
+    for ( unsigned int e=0; e<numEdges; ++e )
+    {
+        unsigned int h = mesh.getEdgeHalfEdge( e ), twin = mesh.getTwin( h );
+        if ( twin==HalfEdgeMesh::INVALID_INDEX )
+        {
+            table.addWeight( mesh.getOrigin(h), 0.5f );
+            table.addWeight( mesh.getTarget(h), 0.5f );
+        }
+        else
+        {
+            table.addWeight( mesh.getOrigin(h), 0.375f );
+            table.addWeight( mesh.getTarget(h), 0.375f );
+            table.addWeight( mesh.getOrigin(mesh.getPrev(h)), 0.125f );
+            table.addWeight( mesh.getOrigin(mesh.getPrev(twin)), 0.125f );
+        }
+        table.finishStencil();
+    }
+
+    unsigned int numFaces = mesh.getNumFaces();
+    faceIndices.resize( numFaces*12 );
+    for ( unsigned int f=0; f<numFaces; ++f )
+    {
+        unsigned int h = mesh.getFaceHalfEdge( f ), v[3], ev[3];
+        for ( unsigned int i=0; i<3; ++i )
+        {
+            v[i] = mesh.getOrigin( h+i );
+            ev[i] = numVertices + mesh.getEdgeIndex( h+i );
+        }
+
+        unsigned int* indices = &faceIndices[f*12];
+        indices[0] = v[0]; indices[1] = ev[0]; indices[2] = ev[2];
+        indices[3] = v[1]; indices[4] = ev[1]; indices[5] = ev[0];
+        indices[6] = v[2]; indices[7] = ev[2]; indices[8] = ev[1];
+        indices[9] = ev[0]; indices[10] = ev[1]; indices[11] = ev[2];
+    }
+}
+
+static const unsigned int s_maxBorderIterations = 2000;
+static const double s_borderTolerance = 1e-12;
+
+/** Multiply weights of a border vertex and its neighbors by the refinement of that ring, which is how the
+ * weights of the old ring act on the new one. Weights are ordered as the vertex and then its neighbors from
+ * one border edge to the other, and the rules are the ones of createLoopRefineStencils(): the interior vertex
+ * rule, midpoints of the two border edges and the interior edge rule elsewhere.
+ */
+static void refineLoopBorderRing( const std::vector<double>& weights, std::vector<double>& result )
+{
+    unsigned int size = weights.size()-1;
+    double self, neighbor;
+    getLoopVertexWeights( size, self, neighbor );
+
+    result.assign( weights.size(), 0.0 );
+    result[0] += weights[0]*self;
+    for ( unsigned int i=1; i<=size; ++i )
+        result[i] += weights[0]*neighbor;
+    for ( unsigned int i=1; i<=size; ++i )
+    {
+        double w = weights[i];
+        if ( i==1 || i==size )
+        {
+            result[0] += w*0.5;
+            result[i] += w*0.5;
+        }
+        else
+        {
+            result[0] += w*0.375;
+            result[i] += w*0.375;
+            result[i-1] += w*0.125;
+            result[i+1] += w*0.125;
+        }
+    }
+}
 
-            pts->push_back( edgeVertex[i] );
-            evIndex[i] = pts->size()-1;
-            _edgeVertices[edge] = evIndex[i];
+/** Scale weights so that the largest one is 1, and return how far they moved from the previous ones. */
+static double normalizeBorderWeights( std::vector<double>& weights, const std::vector<double>& previous )
+{
+    double maxWeight = 0.0, diff = 0.0;
+    for ( unsigned int i=0; i<weights.size(); ++i )
+        maxWeight = osg::maximum( maxWeight, fabs(weights[i]) );
+    if ( maxWeight==0.0 ) return 0.0;
+
+    for ( unsigned int i=0; i<weights.size(); ++i )
+    {
+        weights[i] /= maxWeight;
+        diff = osg::maximum( diff, fabs(weights[i]-previous[i]) );
+    }
+    return diff;
+}
+
+/** Find the dominant tangent mask of a border vertex by power iteration. Tangent masks sum to 0, so the
+ * limit part is removed on each step, and the mask is kept symmetric (sign=1) or antisymmetric (sign=-1)
+ * to the middle of the ring, which separates the across and along directions.
+ */
+static void findLoopBorderTangent( const std::vector<double>& limit, double sign, std::vector<double>& weights )
+{
+    unsigned int size = weights.size()-1;
+    std::vector<double> next;
+    for ( unsigned int n=0; n<s_maxBorderIterations; ++n )
+    {
+        refineLoopBorderRing( weights, next );
+
+        double sum = 0.0;
+        for ( unsigned int i=0; i<next.size(); ++i ) sum += next[i];
+        for ( unsigned int i=0; i<next.size(); ++i ) next[i] -= sum*limit[i];
+
+        for ( unsigned int i=1, j=size; i<=j; ++i, --j )
+        {
+            double w = (next[i]+sign*next[j])*0.5;
+            next[i] = w;
+            next[j] = sign*w;
         }
+        if ( sign<0.0 ) next[0] = 0.0;
+
+        double diff = normalizeBorderWeights( next, weights );
+        weights.swap( next );
+        if ( diff<s_borderTolerance ) break;
     }
+}
+
+/** Limit and tangent masks of a border vertex with a number of neighbors, in the order of the vertex and then
+ * its neighbors. The masks are the dominant left eigenvectors of the ring refinement, so they match the rules
+ * actually used for refining instead of the usual boundary curve rule.
+ */
+struct LoopBorderMasks
+{
+    std::vector<double> _limit;
+    std::vector<double> _along;
+    std::vector<double> _across;
 
-    // Construct new edges and triangles
-    PolyMesh::Face* newFace[4];
-    newFace[0] = new PolyMesh::Face( f->_array, (*f)(0), evIndex[0], evIndex[2] );
-    newFace[1] = new PolyMesh::Face( f->_array, (*f)(1), evIndex[1], evIndex[0] );
-    newFace[2] = new PolyMesh::Face( f->_array, (*f)(2), evIndex[2], evIndex[1] );
-    newFace[3] = new PolyMesh::Face( f->_array, evIndex[0], evIndex[1], evIndex[2] );
-    for ( i=0; i<4; ++i )
+    void create( unsigned int size )
     {
-        PolyMesh::buildEdges( newFace[i], refPts, _tempEdges );
-        _tempFaces.push_back( newFace[i] );
+        // Eigenvalue 1: the limit position
+        std::vector<double> next;
+        _limit.assign( size+1, 0.0 );
+        _limit[0] = 1.0;
+        for ( unsigned int n=0; n<s_maxBorderIterations; ++n )
+        {
+            refineLoopBorderRing( _limit, next );
+            double diff = 0.0;
+            for ( unsigned int i=0; i<next.size(); ++i )
+                diff = osg::maximum( diff, fabs(next[i]-_limit[i]) );
+            _limit.swap( next );
+            if ( diff<s_borderTolerance ) break;
+        }
+
+        // Start from irrational weights, which don't miss any eigenvector of the refinement
+        unsigned int k = size-1;
+        _along.assign( size+1, 0.0 );
+        _across.assign( size+1, 0.0 );
+        for ( unsigned int i=0; i<size; ++i )
+        {
+            double x = i-0.5*k;
+            _along[i+1] = x + osg::PI*x*x*x;
+            _across[i+1] = 1.0 + osg::PI*osg::minimum(i, k-i);
+            _across[0] -= _across[i+1];
+        }
+        findLoopBorderTangent( _limit, -1.0, _along );
+        findLoopBorderTangent( _limit, 1.0, _across );
+
+        // Orient masks on a flat fan of the ring: along from the first neighbor to the last one,
+        // and across pointing out of the surface at the border.
+        double fanAngle = k>1 ? osg::PI : osg::PI_2, x = 0.0, y = 0.0;
+        for ( unsigned int i=0; i<size; ++i )
+        {
+            double angle = fanAngle*i/k;
+            x += _along[i+1]*cos(angle);
+            y += _across[i+1]*sin(angle);
+        }
+        if ( x>0.0 ) for ( unsigned int i=0; i<=size; ++i ) _along[i] = -_along[i];
+        if ( y>0.0 ) for ( unsigned int i=0; i<=size; ++i ) _across[i] = -_across[i];
     }
+};
 
-    // Traverse to neighbor faces
-    f->_flag = 1;   // Sign this face as 'visited'
-    PolyMesh::FaceList flist;
-    mesh->findNeighbors( f, flist );
-    for ( PolyMesh::FaceList::iterator fitr=flist.begin(); fitr!=flist.end(); ++fitr )
-        subdivideFace( mesh, *fitr, refPts, pts );
+/** Create stencils of limit positions and tangents of vertices on the Loop surface.
+ * Interior vertices use the limit of the vertex rule and the cosine and sine masks of the ring. Border
+ * vertices are refined with the interior vertex rule here, so their masks are found from the refinement
+ * of the ring, once for each number of neighbors.
+ */
+static void createLoopLimitStencils( const HalfEdgeMesh& mesh, StencilTable& limit, StencilTable& tangent0, StencilTable& tangent1 )
+{
+    unsigned int numVertices = mesh.getNumVertices();
+    limit.clear( numVertices );
+    tangent0.clear( numVertices );
+    tangent1.clear( numVertices );
+
+    std::vector<LoopBorderMasks> borderMasks;
+    HalfEdgeMesh::IndexList neighbors;
+    for ( unsigned int v=0; v<numVertices; ++v )
+    {
+        neighbors.clear();
+        mesh.findNeighbors( v, neighbors );
+
+        unsigned int size = neighbors.size();
+        if ( size<2 )
+            limit.addWeight( v, 1.0f );
+        else if ( !mesh.isBorderVertex(v) )
+        {
+            // Limit of the vertex rule, with chi = 1 / (3/(8*beta) + n)
+            double self, beta;
+            getLoopVertexWeights( size, self, beta );
+            double chi = 1.0 / (0.375/beta + size);
+            limit.addWeight( v, 1.0-size*chi );
+            for ( unsigned int i=0; i<size; ++i )
+            {
+                double angle = 2.0*osg::PI*i/size;
+                limit.addWeight( neighbors[i], chi );
+                tangent0.addWeight( neighbors[i], cos(angle) );
+                tangent1.addWeight( neighbors[i], sin(angle) );
+            }
+        }
+        else
+        {
+            if ( borderMasks.size()<=size ) borderMasks.resize( size+1 );
+            LoopBorderMasks& masks = borderMasks[size];
+            if ( masks._limit.empty() ) masks.create( size );
+
+            limit.addWeight( v, masks._limit[0] );
+            tangent0.addWeight( v, masks._along[0] );
+            tangent1.addWeight( v, masks._across[0] );
+            for ( unsigned int i=0; i<size; ++i )
+            {
+                limit.addWeight( neighbors[i], masks._limit[i+1] );
+                tangent0.addWeight( neighbors[i], masks._along[i+1] );
+                tangent1.addWeight( neighbors[i], masks._across[i+1] );
+            }
+        }
+        limit.finishStencil();
+        tangent0.finishStencil();
+        tangent1.finishStencil();
+    }
+}
+
+SubdivisionStencils* LoopSubdivision::createStencils( PolyMesh* mesh )
+{
+    osg::ref_ptr<HalfEdgeMesh> hem;
+    osg::ref_ptr<SubdivisionStencils> stencils = createLevelStencils( mesh, createLoopRefineStencils, hem );
+    if ( !stencils.valid() ) return NULL;
+
+    osg::ref_ptr<StencilTable> limit = new StencilTable, tangent0 = new StencilTable, tangent1 = new StencilTable;
+    createLoopLimitStencils( *hem, *limit, *tangent0, *tangent1 );
+    stencils->getLimitStencils()->multiply( *limit, *stencils->getVertexStencils() );
+    stencils->getTangentStencils(0)->multiply( *tangent0, *stencils->getVertexStencils() );
+    stencils->getTangentStencils(1)->multiply( *tangent1, *stencils->getVertexStencils() );
+    return stencils.release();
 }
 
 Sqrt3Subdivision::Sqrt3Subdivision( int level ):
@@ -183,92 +1016,150 @@ void Sqrt3Subdivision::subdivide( PolyMesh* mesh )
 {
     if ( !mesh || !mesh->_faces.size() ) return;
 
-    PolyMesh::MeshType type = mesh->getType();
-    if ( type==PolyMesh::INVALID_MESH || type==PolyMesh::NONMANIFOLD_MESH )
-        return;
-
     osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( mesh->getVertexArray() );
     if ( !vertices || !vertices->size() ) return;
-    unsigned int ptNum = vertices->size();
 
-    osg::ref_ptr<osg::Vec3Array> refVertices = new osg::Vec3Array( vertices->begin(), vertices->end() );
-    subdivideVertices( mesh, refVertices.get(), ptNum );
-    subdivideFace( mesh, mesh->_faces.front(), refVertices.get(), vertices );
-    vertices->erase( vertices->begin(), vertices->begin()+ptNum );
-    vertices->insert( vertices->begin(), refVertices->begin(), refVertices->end() );
+    osg::ref_ptr<HalfEdgeMesh> hem = obtainTriangleHalfEdges( mesh );
+    if ( !hem.valid() ) return;
 
-    // Spin every original edges in the new edge map
-    for ( PolyMesh::EdgeMap::iterator eitr=_tempEdges.begin(); eitr!=_tempEdges.end(); )
+    if ( _criterion.valid() )
     {
-        if ( !eitr->second->_flag )
-        {
-            ++eitr;
-            continue;
-        }
-        eitr->second->_flag = 0;
-        PolyMesh::spinEdge( eitr, _tempEdges );
+        subdivideAdaptive( mesh, *hem );
+        return;
+    }
+    else if ( _maxFaces && hem->getNumFaces()*3>_maxFaces )
+        return;
+
+    // Mesh vertices are moved first, and face centers are appended after them.
+    TaskPool* pool = _parallel ? getTaskPool() : NULL;
+    unsigned int numVertices = hem->getNumVertices(), numFaces = hem->getNumFaces(), numEdges = hem->getNumEdges();
+    osg::ref_ptr<osg::Vec3Array> points = new osg::Vec3Array( numVertices+numFaces );
+    TaskPool::parallelFor( Sqrt3VertexPass(*hem, *points), numVertices, pool, _parallelGrainSize );
+    TaskPool::parallelFor( Sqrt3CenterPass(*hem, *points), numFaces, pool, _parallelGrainSize );
+
+    // Every edge is flipped to connect face centers at both sides. Border edges are kept and form one
+    // triangle with the face center. Offsets of new faces are counted before the parallel pass.
+    HalfEdgeMesh::IndexList faceOffsets( numEdges+1, 0 );
+    for ( unsigned int e=0; e<numEdges; ++e )
+    {
+        bool border = hem->getTwin( hem->getEdgeHalfEdge(e) )==HalfEdgeMesh::INVALID_INDEX;
+        faceOffsets[e+1] = faceOffsets[e] + (border ? 1 : 2);
     }
 
+    PolyMesh::FaceList newFaces( faceOffsets.back() );
+    TaskPool::parallelFor( Sqrt3FlipPass(*hem, faceOffsets, vertices, newFaces), numEdges, pool, _parallelGrainSize );
+
+    vertices->clear();
+    vertices->insert( vertices->end(), points->begin(), points->end() );
     mesh->destroyMesh();
-    mesh->_edges.swap( _tempEdges );
-    mesh->_faces.swap( _tempFaces );
-    _tempEdges.clear();
-    _tempFaces.clear();
+    mesh->_faces.swap( newFaces );
+    mesh->rebuildTopology();
 }
 
-void Sqrt3Subdivision::subdivideVertices( PolyMesh* mesh, osg::Vec3Array* pts, unsigned int ptNum )
+void Sqrt3Subdivision::subdivideAdaptive( PolyMesh* mesh, const HalfEdgeMesh& hem )
 {
-    for ( unsigned int i=0; i<ptNum; ++i )
+    HalfEdgeMesh::IndexList candidates;
+    selectFaces( hem, candidates );
+    if ( !candidates.size() ) return;
+
+    // Every refined face is replaced by 3 faces, which doesn't affect its neighbors.
+    unsigned int numVertices = hem.getNumVertices(), numFaces = hem.getNumFaces(), numEdges = hem.getNumEdges();
+    HalfEdgeMesh::IndexList centers( numFaces, HalfEdgeMesh::INVALID_INDEX );
+    VECTOR<char> moved( numVertices, 0 );
+    unsigned int numPoints = numVertices;
+    for ( HalfEdgeMesh::IndexList::iterator itr=candidates.begin(); itr!=candidates.end(); ++itr )
     {
-        PolyMesh::VertexList vlist;
-        osg::Vec3 vec = (*pts)[i];
-        mesh->findNeighbors( vec, vlist );
+        if ( _maxFaces && numFaces+(numPoints-numVertices+1)*2>_maxFaces ) break;
 
-        unsigned int size = vlist.size();
-        if ( !size ) continue;
-        
-        osg::Vec3 summaryVec( 0.0f, 0.0f, 0.0f );
-        for ( PolyMesh::VertexList::iterator itr=vlist.begin(); itr!=vlist.end(); ++itr )
-            summaryVec += *itr;
+        unsigned int h = hem.getFaceHalfEdge( *itr );
+        centers[*itr] = numPoints++;
+        for ( unsigned int i=0; i<3; ++i )
+            moved[hem.getOrigin(h+i)] = 1;
+    }
+    if ( numPoints==numVertices ) return;
 
-        double beta = (4-2*cos(2*osg::PI/size)) / (9*size);
-        (*pts)[i] = vec*(1-size*beta) + summaryVec*beta;
+    // Faces around edges come first, followed by unrefined faces.
+    HalfEdgeMesh::IndexList edgeOffsets( numEdges+1, 0 );
+    for ( unsigned int e=0; e<numEdges; ++e )
+    {
+        unsigned int h = hem.getEdgeHalfEdge( e ), twin = hem.getTwin( h ), numNewFaces = 0;
+        if ( centers[hem.getFace(h)]!=HalfEdgeMesh::INVALID_INDEX ) numNewFaces++;
+        if ( twin!=HalfEdgeMesh::INVALID_INDEX && centers[hem.getFace(twin)]!=HalfEdgeMesh::INVALID_INDEX ) numNewFaces++;
+        edgeOffsets[e+1] = edgeOffsets[e] + numNewFaces;
     }
+
+    TaskPool* pool = _parallel ? getTaskPool() : NULL;
+    osg::ref_ptr<osg::Vec3Array> points = new osg::Vec3Array( numPoints );
+    TaskPool::parallelFor( Sqrt3VertexPass(hem, *points, &moved), numVertices, pool, _parallelGrainSize );
+    TaskPool::parallelFor( Sqrt3CenterPass(hem, *points, &centers), numFaces, pool, _parallelGrainSize );
+
+    osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( mesh->getVertexArray() );
+    PolyMesh::FaceList newFaces( edgeOffsets.back() );
+    TaskPool::parallelFor( Sqrt3AdaptiveFlipPass(hem, centers, edgeOffsets, vertices, newFaces), numEdges, pool, _parallelGrainSize );
+    for ( unsigned int f=0; f<numFaces; ++f )
+    {
+        if ( centers[f]!=HalfEdgeMesh::INVALID_INDEX ) continue;
+
+        unsigned int h = hem.getFaceHalfEdge( f );
+        newFaces.push_back( new PolyMesh::Face(vertices, hem.getOrigin(h), hem.getOrigin(h+1), hem.getOrigin(h+2)) );
+    }
+
+    vertices->clear();
+    vertices->insert( vertices->end(), points->begin(), points->end() );
+    mesh->destroyMesh();
+    mesh->_faces.swap( newFaces );
+    mesh->rebuildTopology();
 }
 
-void Sqrt3Subdivision::subdivideFace( PolyMesh* mesh, PolyMesh::Face* f, osg::Vec3Array* refPts, osg::Vec3Array* pts )
+/** Create stencils of vertices of the next level from the Sqrt(3) vertex rule and face centers, and faces
+ * created by flipping edges of that level.
+ */
+static void createSqrt3RefineStencils( const HalfEdgeMesh& mesh, StencilTable& table, HalfEdgeMesh::IndexList& faceIndices )
 {
-    if ( !f || f->_flag ) return;
+    unsigned int numVertices = mesh.getNumVertices(), numFaces = mesh.getNumFaces(), numEdges = mesh.getNumEdges();
+    table.clear( numVertices );
 
-    // Create new point, only for triangles
-    osg::Vec3 newVec = ((*f)[0]+(*f)[1]+(*f)[2]) / 3.0f;
-    pts->push_back( newVec );
-    int newIndex = pts->size()-1;
-
-    // Construct new edges and triangles
-    PolyMesh::Face* newFace[4];
-    newFace[0] = new PolyMesh::Face( f->_array, (*f)(0), (*f)(1), newIndex );
-    newFace[1] = new PolyMesh::Face( f->_array, (*f)(1), (*f)(2), newIndex );
-    newFace[2] = new PolyMesh::Face( f->_array, (*f)(2), (*f)(0), newIndex );
-    for ( int i=0; i<3; ++i )
+    HalfEdgeMesh::IndexList neighbors;
+    for ( unsigned int v=0; v<numVertices; ++v )
     {
-        PolyMesh::buildEdges( newFace[i], refPts, _tempEdges );
-        _tempFaces.push_back( newFace[i] );
+        neighbors.clear();
+        mesh.findNeighbors( v, neighbors );
+
+        double self, neighbor;
+        getSqrt3VertexWeights( neighbors.size(), self, neighbor );
+        table.addWeight( v, self );
+        for ( HalfEdgeMesh::IndexList::iterator itr=neighbors.begin(); itr!=neighbors.end(); ++itr )
+            table.addWeight( *itr, neighbor );
+        table.finishStencil();
     }
 
-    // Mark original edges for spinning later
-    for ( unsigned int i=0; i<3; ++i )
+    for ( unsigned int f=0; f<numFaces; ++f )
     {
-        PolyMesh::Edge* edge =
-            PolyMesh::getEdge( (*refPts)[(*f)(i%3)], (*refPts)[(*f)((i+1)%3)], _tempEdges );
-        if ( edge ) edge->_flag = 1;
+        unsigned int h = mesh.getFaceHalfEdge( f );
+        for ( unsigned int i=0; i<3; ++i ) table.addWeight( mesh.getOrigin(h+i), 1.0f/3.0f );
+        table.finishStencil();
     }
 
-    // Traverse to neighbor faces
-    f->_flag = 1;   // Sign this face as 'visited'
-    PolyMesh::FaceList flist;
-    mesh->findNeighbors( f, flist );
-    for ( PolyMesh::FaceList::iterator fitr=flist.begin(); fitr!=flist.end(); ++fitr )
-        subdivideFace( mesh, *fitr, refPts, pts );
+    faceIndices.clear();
+    for ( unsigned int e=0; e<numEdges; ++e )
+    {
+        unsigned int h = mesh.getEdgeHalfEdge( e ), twin = mesh.getTwin( h );
+        unsigned int v0=mesh.getOrigin(h), v1=mesh.getTarget(h), center=numVertices+mesh.getFace(h);
+        if ( twin==HalfEdgeMesh::INVALID_INDEX )
+        {
+            faceIndices.push_back( v0 ); faceIndices.push_back( v1 ); faceIndices.push_back( center );
+        }
+        else
+        {
+            unsigned int twinCenter = numVertices+mesh.getFace(twin);
+            faceIndices.push_back( twinCenter ); faceIndices.push_back( v1 ); faceIndices.push_back( center );
+            faceIndices.push_back( center ); faceIndices.push_back( v0 ); faceIndices.push_back( twinCenter );
+        }
+    }
 }
 
+SubdivisionStencils* Sqrt3Subdivision::createStencils( PolyMesh* mesh )
+{
+    osg::ref_ptr<HalfEdgeMesh> hem;
+    return createLevelStencils( mesh, createSqrt3RefineStencils, hem );
+}
@@ -0,0 +1,167 @@
+/* -*-c++-*- osgModeling - Copyright (C) 2008 Wang Rui <wangray84@gmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <OpenThreads/ScopedLock>
+#include <osgModeling/TaskPool>
+
+using namespace osgModeling;
+
+void TaskPool::Worker::run()
+{
+    while ( true )
+    {
+        if ( _pool->runOneTask(_index) ) continue;
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _pool->_sleepMutex );
+        if ( _pool->_done ) break;
+        if ( _pool->_numQueued<=0 )
+            _pool->_sleepCondition.wait( &_pool->_sleepMutex );
+    }
+}
+
+TaskPool::TaskPool( unsigned int numThreads ):
+    osg::Referenced(), _numQueued(0), _done(false)
+{
+    if ( !numThreads ) numThreads = OpenThreads::GetNumberOfProcessors();
+
+    // The last queue is shared by threads not belonging to the pool.
+    for ( unsigned int i=0; i<=numThreads; ++i )
+        _queues.push_back( new TaskQueue );
+
+    for ( unsigned int i=0; i<numThreads; ++i )
+    {
+        Worker* worker = new Worker( this, i );
+        _workers.push_back( worker );
+        worker->start();
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _sleepMutex );
+        _done = true;
+        _sleepCondition.broadcast();
+    }
+
+    for ( unsigned int i=0; i<_workers.size(); ++i )
+    {
+        _workers[i]->join();
+        delete _workers[i];
+    }
+    for ( unsigned int i=0; i<_queues.size(); ++i )
+        delete _queues[i];
+}
+
+TaskPool* TaskPool::instance()
+{
+    static osg::ref_ptr<TaskPool> s_taskPool = new TaskPool;
+    return s_taskPool.get();
+}
+
+void TaskPool::spawn( Task* task, TaskGroup* group )
+{
+    if ( !task || !group ) return;
+
+    ++group->_pending;
+    TaskQueue* queue = _queues[getQueueIndex()];
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( queue->_mutex );
+        queue->_entries.push_back( TaskEntry(task, group) );
+    }
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _sleepMutex );
+    _numQueued++;
+    _sleepCondition.signal();
+}
+
+void TaskPool::wait( TaskGroup* group )
+{
+    if ( !group ) return;
+
+    unsigned int index = getQueueIndex();
+    while ( !group->done() )
+    {
+        if ( runOneTask(index) ) continue;
+
+        // Nothing to help with, so sleep until a task is spawned or a group is finished.
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _sleepMutex );
+        if ( !group->done() && _numQueued<=0 )
+            _sleepCondition.wait( &_sleepMutex );
+    }
+}
+
+unsigned int TaskPool::getQueueIndex() const
+{
+    OpenThreads::Thread* current = OpenThreads::Thread::CurrentThread();
+    for ( unsigned int i=0; i<_workers.size(); ++i )
+    {
+        if ( _workers[i]==current ) return i;
+    }
+    return _workers.size();
+}
+
+bool TaskPool::popTask( unsigned int index, TaskEntry& entry )
+{
+    // Newest tasks of own queue are still hot in cache, so take them first.
+    TaskQueue* own = _queues[index];
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( own->_mutex );
+        if ( own->_entries.size()>0 )
+        {
+            entry = own->_entries.back();
+            own->_entries.pop_back();
+            return true;
+        }
+    }
+
+    // Steal the oldest, which are usually the largest, tasks from others.
+    unsigned int size = _queues.size();
+    for ( unsigned int i=1; i<size; ++i )
+    {
+        TaskQueue* other = _queues[(index+i)%size];
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( other->_mutex );
+        if ( other->_entries.size()>0 )
+        {
+            entry = other->_entries.front();
+            other->_entries.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TaskPool::runOneTask( unsigned int index )
+{
+    TaskEntry entry;
+    if ( !popTask(index, entry) ) return false;
+
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _sleepMutex );
+        _numQueued--;
+    }
+
+    entry._task->run();
+    entry._task = NULL;
+    if ( !(--entry._group->_pending) )
+    {
+        // Wake threads waiting for the group. Notify under the lock so the wake-up can't be missed.
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _sleepMutex );
+        _sleepCondition.broadcast();
+    }
+    return true;
+}
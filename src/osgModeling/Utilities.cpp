@@ -335,6 +335,147 @@ double osgModeling::checkOrientation( const osg::Vec3 v1, const osg::Vec3 v2, co
     }
 }
 
+/** Projected polygon used for ear clipping. */
+struct EarClipper
+{
+    std::vector<double> _x, _y;
+    std::vector<unsigned int> _prev, _next;
+    std::vector<char> _convex;
+    double _orientation;
+
+    /** Twice the signed area of triangle (a,b,c), positive if it has the same orientation with the polygon. */
+    inline double area( unsigned int a, unsigned int b, unsigned int c ) const
+    { return _orientation * ((_x[b]-_x[a])*(_y[c]-_y[a]) - (_y[b]-_y[a])*(_x[c]-_x[a])); }
+
+    inline bool samePoint( unsigned int a, unsigned int b ) const
+    { return _x[a]==_x[b] && _y[a]==_y[b]; }
+
+    /** A vertex is convex if the turning angle is large enough. Collinear vertices are not convex. */
+    inline bool isConvex( unsigned int i ) const
+    {
+        unsigned int p=_prev[i], n=_next[i];
+        double e1 = (_x[i]-_x[p])*(_x[i]-_x[p]) + (_y[i]-_y[p])*(_y[i]-_y[p]);
+        double e2 = (_x[n]-_x[i])*(_x[n]-_x[i]) + (_y[n]-_y[i])*(_y[n]-_y[i]);
+        return area(p, i, n) > 1e-5*sqrt(e1*e2);
+    }
+
+    inline bool inTriangle( unsigned int v, unsigned int a, unsigned int b, unsigned int c ) const
+    { return area(a, b, v)>=0.0 && area(b, c, v)>=0.0 && area(c, a, v)>=0.0; }
+};
+
+bool osgModeling::triangulatePolygon( const osg::Vec3* points, const unsigned int* indices, unsigned int size,
+                                      osg::Vec3 normal, std::vector<unsigned int>& triangles )
+{
+    if ( !points || size<3 ) return false;
+
+    unsigned int i;
+    if ( normal.length2()==0.0f )
+    {
+        // Newell's method, which works for concave polygons too.
+        for ( i=0; i<size; ++i )
+        {
+            const osg::Vec3& curr = points[indices ? indices[i] : i];
+            const osg::Vec3& next = points[indices ? indices[(i+1)%size] : (i+1)%size];
+            normal.x() += (curr.y()-next.y()) * (curr.z()+next.z());
+            normal.y() += (curr.z()-next.z()) * (curr.x()+next.x());
+            normal.z() += (curr.x()-next.x()) * (curr.y()+next.y());
+        }
+    }
+
+    // Project the polygon to the coordinate plane most parallel to it.
+    unsigned int axis = 2;
+    if ( fabs(normal.x())>fabs(normal.y()) && fabs(normal.x())>fabs(normal.z()) ) axis = 0;
+    else if ( fabs(normal.y())>fabs(normal.z()) ) axis = 1;
+    unsigned int axisX=(axis+1)%3, axisY=(axis+2)%3;
+
+    EarClipper ec;
+    ec._x.resize( size );
+    ec._y.resize( size );
+    ec._prev.resize( size );
+    ec._next.resize( size );
+    ec._convex.resize( size );
+    double signedArea = 0.0;
+    for ( i=0; i<size; ++i )
+    {
+        const osg::Vec3& pt = points[indices ? indices[i] : i];
+        ec._x[i] = pt[axisX];
+        ec._y[i] = pt[axisY];
+        ec._prev[i] = (i+size-1)%size;
+        ec._next[i] = (i+1)%size;
+    }
+    for ( i=0; i<size; ++i )
+        signedArea += ec._x[ec._prev[i]]*ec._y[i] - ec._x[i]*ec._y[ec._prev[i]];
+    if ( signedArea==0.0 ) return false;
+    ec._orientation = signedArea>0.0 ? 1.0 : -1.0;
+
+    // Only reflex and collinear vertices may be inside an ear.
+    std::vector<unsigned int> reflexList;
+    for ( i=0; i<size; ++i )
+    {
+        ec._convex[i] = ec.isConvex(i);
+        if ( !ec._convex[i] ) reflexList.push_back( i );
+    }
+
+    unsigned int remaining=size, curr=0, stalled=0;
+    while ( remaining>3 )
+    {
+        unsigned int p=ec._prev[curr], n=ec._next[curr];
+        bool isEar = ec._convex[curr]!=0;
+        for ( unsigned int r=0; isEar && r<reflexList.size(); )
+        {
+            unsigned int v = reflexList[r];
+            if ( ec._convex[v] )
+            {
+                // Remove clipped and convex vertices from the list.
+                reflexList[r] = reflexList.back();
+                reflexList.pop_back();
+                continue;
+            }
+
+            if ( v!=p && v!=curr && v!=n && !ec.samePoint(v, p) && !ec.samePoint(v, curr) && !ec.samePoint(v, n) )
+                isEar = !ec.inTriangle( v, p, curr, n );
+            ++r;
+        }
+
+        // Clip the vertex anyway if there is no ear in the whole loop, which happens for degenerated polygons.
+        if ( isEar || stalled>=remaining )
+        {
+            if ( ec.area(p, curr, n)>0.0 )
+            {
+                triangles.push_back( indices ? indices[p] : p );
+                triangles.push_back( indices ? indices[curr] : curr );
+                triangles.push_back( indices ? indices[n] : n );
+            }
+
+            ec._next[p] = n;
+            ec._prev[n] = p;
+            ec._convex[curr] = 1;  // Clipped vertices are removed from the reflex list
+            bool convexP=ec._convex[p]!=0, convexN=ec._convex[n]!=0;
+            ec._convex[p] = ec.isConvex(p);
+            ec._convex[n] = ec.isConvex(n);
+            if ( convexP && !ec._convex[p] ) reflexList.push_back( p );
+            if ( convexN && !ec._convex[n] ) reflexList.push_back( n );
+            remaining--;
+            curr = n;
+            stalled = 0;
+        }
+        else
+        {
+            curr = n;
+            stalled++;
+        }
+    }
+
+    unsigned int p=ec._prev[curr], n=ec._next[curr];
+    if ( ec.area(p, curr, n)>0.0 )
+    {
+        triangles.push_back( indices ? indices[p] : p );
+        triangles.push_back( indices ? indices[curr] : curr );
+        triangles.push_back( indices ? indices[n] : n );
+    }
+    return true;
+}
+
 double osgModeling::determinant( osg::Matrix2 m )
 {
     return m[0]*m[3] - m[1]*m[2];
@@ -367,3 +508,131 @@ double osgModeling::factorial( const int n, bool warnLargeValue )
         result *= i++;
     return result;
 }
+
+unsigned int osgModeling::findKnotSpan( const double* knots, unsigned int degree, unsigned int numCtrl, double u )
+{
+    if ( numCtrl<degree+2 ) return degree;
+
+    // Find the first knot not less than u in knots[degree+1] to knots[numCtrl-1].
+    const double* knot = std::lower_bound( knots+degree+1, knots+numCtrl, u );
+    return (knot - knots) - 1;
+}
+
+void osgModeling::calcBasisFunctions( const double* knots, unsigned int span, unsigned int degree, double u, double* basis )
+{
+    // Differences to knots are kept on the stack for usual degrees.
+    double localBuffer[32];
+    std::vector<double> heapBuffer;
+    double* left = localBuffer;
+    if ( degree>=16 )
+    {
+        heapBuffer.resize( 2*(degree+1) );
+        left = &(heapBuffer.front());
+    }
+    double* right = left + degree+1;
+
+    basis[0] = 1.0;
+    for ( unsigned int j=1; j<=degree; ++j )
+    {
+        left[j] = u - knots[span+1-j];
+        right[j] = knots[span+j] - u;
+
+        double saved = 0.0;
+        for ( unsigned int r=0; r<j; ++r )
+        {
+            double base = right[r+1] + left[j-r];
+            double temp = base!=0.0 ? basis[r]/base : 0.0;
+            basis[r] = saved + right[r+1]*temp;
+            saved = left[j-r]*temp;
+        }
+        basis[j] = saved;
+    }
+}
+
+void osgModeling::calcBasisDerivatives( const double* knots, unsigned int span, unsigned int degree, double u,
+                                        unsigned int numDers, double* ders )
+{
+    int p = degree, n = osg::minimum( numDers, degree );
+    unsigned int order = degree+1;
+
+    // Keep the triangular table, knot differences and 2 rows of coefficients on the stack for usual degrees.
+    double localBuffer[16*16+4*16];
+    std::vector<double> heapBuffer;
+    double* ndu = localBuffer;
+    if ( degree>=16 )
+    {
+        heapBuffer.resize( order*order+4*order );
+        ndu = &(heapBuffer.front());
+    }
+    double* left = ndu + order*order;
+    double* right = left + order;
+    double* a[2] = { right+order, right+2*order };
+
+    // ndu[j*order+r] holds basis functions of degree j in its upper triangle, and knot differences in the lower.
+    ndu[0] = 1.0;
+    for ( int j=1; j<=p; ++j )
+    {
+        left[j] = u - knots[span+1-j];
+        right[j] = knots[span+j] - u;
+
+        double saved = 0.0;
+        for ( int r=0; r<j; ++r )
+        {
+            ndu[j*order+r] = right[r+1] + left[j-r];
+            double temp = ndu[j*order+r]!=0.0 ? ndu[r*order+j-1]/ndu[j*order+r] : 0.0;
+            ndu[r*order+j] = saved + right[r+1]*temp;
+            saved = left[j-r]*temp;
+        }
+        ndu[j*order+j] = saved;
+    }
+
+    for ( int j=0; j<=p; ++j )
+        ders[j] = ndu[j*order+p];
+
+    for ( int r=0; r<=p; ++r )
+    {
+        int s1=0, s2=1;
+        a[0][0] = 1.0;
+        for ( int k=1; k<=n; ++k )
+        {
+            double d = 0.0, base;
+            int rk=r-k, pk=p-k;
+            if ( r>=k )
+            {
+                base = ndu[(pk+1)*order+rk];
+                a[s2][0] = base!=0.0 ? a[s1][0]/base : 0.0;
+                d = a[s2][0] * ndu[rk*order+pk];
+            }
+
+            int j1 = rk>=-1 ? 1 : -rk;
+            int j2 = r-1<=pk ? k-1 : p-r;
+            for ( int j=j1; j<=j2; ++j )
+            {
+                base = ndu[(pk+1)*order+rk+j];
+                a[s2][j] = base!=0.0 ? (a[s1][j]-a[s1][j-1])/base : 0.0;
+                d += a[s2][j] * ndu[(rk+j)*order+pk];
+            }
+
+            if ( r<=pk )
+            {
+                base = ndu[(pk+1)*order+r];
+                a[s2][k] = base!=0.0 ? -a[s1][k-1]/base : 0.0;
+                d += a[s2][k] * ndu[r*order+pk];
+            }
+            ders[k*order+r] = d;
+            std::swap( s1, s2 );
+        }
+    }
+
+    // Multiply by the factors p!/(p-k)!.
+    double factor = p;
+    for ( int k=1; k<=n; ++k )
+    {
+        for ( int j=0; j<=p; ++j ) ders[k*order+j] *= factor;
+        factor *= (p-k);
+    }
+    for ( unsigned int k=n+1; k<=numDers; ++k )
+    {
+        for ( unsigned int j=0; j<order; ++j ) ders[k*order+j] = 0.0;
+    }
+}
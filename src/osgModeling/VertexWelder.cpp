@@ -0,0 +1,195 @@
+/* -*-c++-*- osgModeling - Copyright (C) 2008 Wang Rui <wangray84@gmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <cmath>
+#include <cstring>
+#include <osgModeling/Utilities>
+#include <osgModeling/VertexWelder>
+
+using namespace osgModeling;
+
+// Size of grid cells in tolerances. Vertices only check neighbor cells when near the cell border.
+static const double s_cellSizeScale = 64.0;
+
+static inline unsigned int hashDouble( double value )
+{
+    // Add 0 so that -0.0 and 0.0 are hashed the same.
+    value += 0.0;
+    unsigned int bits[2];
+    memcpy( bits, &value, sizeof(double) );
+    return bits[0] ^ (bits[1]*0x9e3779b9u);
+}
+
+VertexWelder::VertexWelder( double tolerance, unsigned int expectedVertices ):
+    _tolerance(0.0), _invCellSize(0.0), _bucketMask(0)
+{
+    reset( tolerance, expectedVertices );
+}
+
+void VertexWelder::reset( double tolerance, unsigned int expectedVertices )
+{
+    _tolerance = tolerance>0.0 ? tolerance : 0.0;
+    _invCellSize = _tolerance>0.0 ? 1.0/(_tolerance*s_cellSizeScale) : 0.0;
+    _vertices = new osg::Vec3Array;
+    _vertices->reserve( expectedVertices );
+    _next.clear();
+    _next.reserve( expectedVertices );
+
+    unsigned int numBuckets = 16;
+    while ( numBuckets<expectedVertices*2 && numBuckets<0x40000000 ) numBuckets <<= 1;
+    _buckets.clear();
+    rehash( numBuckets );
+}
+
+unsigned int VertexWelder::weld( const osg::Vec3& v )
+{
+    // Grow before searching, so the home bucket from the search is still valid for inserting.
+    if ( _vertices->size()>=_buckets.size() ) rehash( _buckets.size()*2 );
+
+    unsigned int bucket = 0;
+    unsigned int index = find( v, bucket );
+    if ( index!=INVALID_INDEX ) return index;
+
+    index = _vertices->size();
+    _vertices->push_back( v );
+    _next.push_back( _buckets[bucket] );
+    _buckets[bucket] = index;
+    return index;
+}
+
+unsigned int VertexWelder::find( const osg::Vec3& v ) const
+{
+    unsigned int bucket = 0;
+    return find( v, bucket );
+}
+
+unsigned int VertexWelder::find( const osg::Vec3& v, unsigned int& homeBucket ) const
+{
+    if ( _tolerance<=0.0 )
+    {
+        homeBucket = hashCell( v.x(), v.y(), v.z() );
+        return findInBucket( homeBucket, v );
+    }
+
+    // Check all cells overlapping the tolerance box, which is usually only one.
+    // Cells are larger than the box, so there are at most 2 cells on each axis.
+    double cells[3][2], home[3];
+    unsigned int numCells[3];
+    for ( unsigned int i=0; i<3; ++i )
+    {
+        home[i] = floor( v[i]*_invCellSize );
+        cells[i][0] = floor( (v[i]-_tolerance)*_invCellSize );
+        cells[i][1] = floor( (v[i]+_tolerance)*_invCellSize );
+        numCells[i] = cells[i][1]>cells[i][0] ? 2 : 1;
+    }
+
+    // The cell containing the vertex is always one of them, so its bucket is recorded on the way.
+    bool homeFound = false;
+    for ( unsigned int x=0; x<numCells[0]; ++x )
+    {
+        for ( unsigned int y=0; y<numCells[1]; ++y )
+        {
+            for ( unsigned int z=0; z<numCells[2]; ++z )
+            {
+                unsigned int bucket = hashCell( cells[0][x], cells[1][y], cells[2][z] );
+                if ( cells[0][x]==home[0] && cells[1][y]==home[1] && cells[2][z]==home[2] )
+                {
+                    homeBucket = bucket;
+                    homeFound = true;
+                }
+
+                unsigned int index = findInBucket( bucket, v );
+                if ( index!=INVALID_INDEX ) return index;
+            }
+        }
+    }
+    if ( !homeFound ) homeBucket = hashCell( home[0], home[1], home[2] );
+    return INVALID_INDEX;
+}
+
+unsigned int VertexWelder::hashCell( double x, double y, double z ) const
+{
+    unsigned int h = hashDouble( x );
+    h = h*73856093u ^ hashDouble( y );
+    h = h*19349663u ^ hashDouble( z );
+    h ^= h>>16;
+    return h & _bucketMask;
+}
+
+unsigned int VertexWelder::hashVertex( const osg::Vec3& v ) const
+{
+    if ( _tolerance<=0.0 ) return hashCell( v.x(), v.y(), v.z() );
+    return hashCell( floor(v.x()*_invCellSize), floor(v.y()*_invCellSize), floor(v.z()*_invCellSize) );
+}
+
+unsigned int VertexWelder::findInBucket( unsigned int bucket, const osg::Vec3& v ) const
+{
+    // Different cells may share a bucket, so always compare the vertices themselves.
+    for ( unsigned int index=_buckets[bucket]; index!=INVALID_INDEX; index=_next[index] )
+    {
+        const osg::Vec3& w = (*_vertices)[index];
+        if ( _tolerance>0.0 ? equivalent(v, w, _tolerance) : v==w )
+            return index;
+    }
+    return INVALID_INDEX;
+}
+
+void VertexWelder::rehash( unsigned int numBuckets )
+{
+    _buckets.assign( numBuckets, (unsigned int)INVALID_INDEX );
+    _bucketMask = numBuckets-1;
+
+    // Insert in the original order, so buckets are the same as if they were never rehashed.
+    for ( unsigned int i=0; i<_vertices->size(); ++i )
+    {
+        unsigned int bucket = hashVertex( (*_vertices)[i] );
+        _next[i] = _buckets[bucket];
+        _buckets[bucket] = i;
+    }
+}
+
+VertexGroupIndex::VertexGroupIndex( double tolerance ):
+    _welder(tolerance)
+{
+}
+
+void VertexGroupIndex::build( const osg::Vec3Array* vertices )
+{
+    if ( !vertices || !vertices->size() ) build( NULL, 0 );
+    else build( &(vertices->front()), vertices->size() );
+}
+
+void VertexGroupIndex::build( const osg::Vec3* vertices, unsigned int numVertices )
+{
+    _welder.reset( _welder.getTolerance(), numVertices );
+    _groupOfVertex.resize( numVertices );
+    for ( unsigned int i=0; i<numVertices; ++i )
+        _groupOfVertex[i] = _welder.weld( vertices[i] );
+
+    // Count vertices of each group and then place them, so groups keep the order of the array.
+    unsigned int numGroups = _welder.getNumVertices();
+    _groupOffsets.assign( numGroups+1, 0 );
+    for ( unsigned int i=0; i<numVertices; ++i )
+        ++_groupOffsets[_groupOfVertex[i]+1];
+    for ( unsigned int g=0; g<numGroups; ++g )
+        _groupOffsets[g+1] += _groupOffsets[g];
+
+    std::vector<unsigned int> fill( _groupOffsets.begin(), _groupOffsets.end()-1 );
+    _members.resize( numVertices );
+    for ( unsigned int i=0; i<numVertices; ++i )
+        _members[fill[_groupOfVertex[i]]++] = i;
+}